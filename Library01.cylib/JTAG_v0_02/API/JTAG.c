@@ -11,6 +11,17 @@
  */
 
 #include "`$INSTANCE_NAME`.h"
+#include <CyLib.h>
+#include <string.h>
+
+// Long shifts are moved by DMA if the DMA components of the datapath DRQs are placed:
+// DMA_TX on F0 not full, and DMA_RX on F1 not empty.
+#if defined(`$INSTANCE_NAME`_DMA_TX__DRQ_NUMBER) && defined(`$INSTANCE_NAME`_DMA_RX__DRQ_NUMBER)
+#define `$INSTANCE_NAME`_DMA 1
+#include <CyDmac.h>
+#include "`$INSTANCE_NAME`_DMA_TX_dma.h"
+#include "`$INSTANCE_NAME`_DMA_RX_dma.h"
+#endif
 
 /**************************************
  * Macros
@@ -20,14 +31,29 @@
 #define CMD_TMS (1 << 4)
 #define CMD_TDI (0 << 4)
 #define CMD_LAST_TMS (1 << 5)
+#define FIFO_DEPTH (4)
+#define DMA_MIN_BYTES (16u) // shorter shifts are fed by the CPU
+#define DMA_CHUNK (128u)    // bytes per DMA transfer, bit reversed in LSB first mode
+
+// Lower 16 bits of an SRAM or peripheral address, for a DMA TD.
+#if !defined(`$INSTANCE_NAME`_DMA_ADDR)
+#define `$INSTANCE_NAME`_DMA_ADDR(p) LO16((uint32)(p))
+#endif
+
+// Reverse the bits of a byte, and of each byte in a word, by RBIT instead of a table.
+#define REVERSE8(b) ((uint8)(__RBIT(b) >> 24))
+#define REVERSE8X4(w) __REV(__RBIT(w))
 
 /**************************************
  * Variables
  *************************************/
+// All variables are static, so that more than one instance can be placed.
+
 // clang-format off
 
+// Generated by tools/gen_tap_tables.py. Tables are const, so they stay in flash.
 // transition counts between two states.
-uint8 trans_cnt[16][16] = {
+static const uint8 trans_cnt[16][16] = {
  0, 1, 2, 3, 4, 4, 5, 6,  5, 3, 4, 5, 5, 6, 7, 6,
  3, 0, 1, 2, 3, 3, 4, 5,  4, 2, 3, 4, 4, 5, 6, 5,
  2, 3, 0, 1, 2, 2, 3, 4,  3, 1, 2, 3, 3, 4, 5, 4,
@@ -48,7 +74,7 @@ uint8 trans_cnt[16][16] = {
 };
 
 // TMS bit sequence between two states.
-uint8 trans_TMS[16][16] = {
+static const uint8 trans_TMS[16][16] = {
  0x00, 0x00, 0x40, 0x40, 0x40, 0x50, 0x50, 0x54,  0x58, 0x60, 0x60, 0x60, 0x68, 0x68, 0x6a, 0x6c,
  0xe0, 0x00, 0x80, 0x80, 0x80, 0xa0, 0xa0, 0xa8,  0xb0, 0xc0, 0xc0, 0xc0, 0xd0, 0xd0, 0xd4, 0xd8,
  0xc0, 0xc0, 0x00, 0x00, 0x00, 0x40, 0x40, 0x50,  0x60, 0x80, 0x80, 0x80, 0xa0, 0xa0, 0xa8, 0xb0,
@@ -68,38 +94,47 @@ uint8 trans_TMS[16][16] = {
  0xe0, 0x00, 0x80, 0x80, 0x80, 0xa0, 0xa0, 0xa8,  0xb0, 0xc0, 0xc0, 0xc0, 0xd0, 0xd0, 0xd4, 0x00
 };
 
-uint8 bit_reversal[256] = {
- 0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0,  0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0,
- 0x08, 0x88, 0x48, 0xc8, 0x28, 0xa8, 0x68, 0xe8,  0x18, 0x98, 0x58, 0xd8, 0x38, 0xb8, 0x78, 0xf8,
- 0x04, 0x84, 0x44, 0xc4, 0x24, 0xa4, 0x64, 0xe4,  0x14, 0x94, 0x54, 0xd4, 0x34, 0xb4, 0x74, 0xf4,
- 0x0c, 0x8c, 0x4c, 0xcc, 0x2c, 0xac, 0x6c, 0xec,  0x1c, 0x9c, 0x5c, 0xdc, 0x3c, 0xbc, 0x7c, 0xfc,
- 0x02, 0x82, 0x42, 0xc2, 0x22, 0xa2, 0x62, 0xe2,  0x12, 0x92, 0x52, 0xd2, 0x32, 0xb2, 0x72, 0xf2,
- 0x0a, 0x8a, 0x4a, 0xca, 0x2a, 0xaa, 0x6a, 0xea,  0x1a, 0x9a, 0x5a, 0xda, 0x3a, 0xba, 0x7a, 0xfa,
- 0x06, 0x86, 0x46, 0xc6, 0x26, 0xa6, 0x66, 0xe6,  0x16, 0x96, 0x56, 0xd6, 0x36, 0xb6, 0x76, 0xf6,
- 0x0e, 0x8e, 0x4e, 0xce, 0x2e, 0xae, 0x6e, 0xee,  0x1e, 0x9e, 0x5e, 0xde, 0x3e, 0xbe, 0x7e, 0xfe,
- 
- 0x01, 0x81, 0x41, 0xc1, 0x21, 0xa1, 0x61, 0xe1,  0x11, 0x91, 0x51, 0xd1, 0x31, 0xb1, 0x71, 0xf1,
- 0x09, 0x89, 0x49, 0xc9, 0x29, 0xa9, 0x69, 0xe9,  0x19, 0x99, 0x59, 0xd9, 0x39, 0xb9, 0x79, 0xf9,
- 0x05, 0x85, 0x45, 0xc5, 0x25, 0xa5, 0x65, 0xe5,  0x15, 0x95, 0x55, 0xd5, 0x35, 0xb5, 0x75, 0xf5,
- 0x0d, 0x8d, 0x4d, 0xcd, 0x2d, 0xad, 0x6d, 0xed,  0x1d, 0x9d, 0x5d, 0xdd, 0x3d, 0xbd, 0x7d, 0xfd,
- 0x03, 0x83, 0x43, 0xc3, 0x23, 0xa3, 0x63, 0xe3,  0x13, 0x93, 0x53, 0xd3, 0x33, 0xb3, 0x73, 0xf3,
- 0x0b, 0x8b, 0x4b, 0xcb, 0x2b, 0xab, 0x6b, 0xeb,  0x1b, 0x9b, 0x5b, 0xdb, 0x3b, 0xbb, 0x7b, 0xfb,
- 0x07, 0x87, 0x47, 0xc7, 0x27, 0xa7, 0x67, 0xe7,  0x17, 0x97, 0x57, 0xd7, 0x37, 0xb7, 0x77, 0xf7,
- 0x0f, 0x8f, 0x4f, 0xcf, 0x2f, 0xaf, 0x6f, 0xef,  0x1f, 0x9f, 0x5f, 0xdf, 0x3f, 0xbf, 0x7f, 0xff
+// Next TAP state for TMS low and high.
+static const uint8 tap_next[16][2] = {
+ { 1,  0}, { 1,  2}, { 3,  9}, { 4,  5}, { 4,  5}, { 6,  8}, { 6,  7}, { 4,  8},
+ { 1,  2}, {10,  0}, {11, 12}, {11, 12}, {13, 15}, {13, 14}, {11, 15}, { 1,  2}
 };
 
 // clang-format on
 
-uint8 TAP_State = 0;
-uint8 Shift_Dir = 0;
+static uint8 TAP_State = 0;
+static uint8 Shift_Dir = 0;
+static uint32 wait_cycles = 0; // CPU cycles spent waiting for the datapath
+
+// Clock burst state.
+static uint32 burst_bytes;  // bytes (8 clocks each) not yet queued to F0
+static uint8 burst_queued;  // bytes in F0 or being shifted
+static uint8 burst_rest;    // clocks after the last full byte
+
+#if defined(`$INSTANCE_NAME`_DMA)
+static uint8 dma_tx_ch, dma_rx_ch;
+static uint8 dma_tx_td, dma_rx_td;
+static uint8 dma_tdi[DMA_CHUNK]; // TDI bit reversed for LSB first mode
+static uint8 dma_discard;        // TDO which is not captured
+#endif
 
 /**************************************
  * Function Prototypes
  *************************************/
 static uint8 run_cmd(uint8 cmd, uint8 outBits);
+static void shift_bytes(uint8 cmd, uint32 count, const uint8 *out_bytes, uint8 *in_bytes, uint8 lsb_first);
+#if defined(`$INSTANCE_NAME`_DMA)
+static void shift_bytes_dma(uint32 count, const uint8 *out_bytes, uint8 *in_bytes, uint8 lsb_first);
+#endif
 
-// Initialize JTAG component.
+// Initialize JTAG component. Each DMA channel has one TD, set up for each transfer.
 void `$INSTANCE_NAME`_Start() {
+#if defined(`$INSTANCE_NAME`_DMA)
+    dma_tx_ch = `$INSTANCE_NAME`_DMA_TX_DmaInitialize(1, 1, HI16(CYDEV_SRAM_BASE), HI16(CYDEV_PERIPH_BASE));
+    dma_rx_ch = `$INSTANCE_NAME`_DMA_RX_DmaInitialize(1, 1, HI16(CYDEV_PERIPH_BASE), HI16(CYDEV_SRAM_BASE));
+    dma_tx_td = CyDmaTdAllocate();
+    dma_rx_td = CyDmaTdAllocate();
+#endif
     `$INSTANCE_NAME`_Reset(); }
 
 // clang-format off
@@ -113,6 +148,9 @@ void `$INSTANCE_NAME`_Reset() {
     `$INSTANCE_NAME`_Datapath_1_F0_CLEAR;
     `$INSTANCE_NAME`_Datapath_1_F1_CLEAR;
     TAP_State = 0;
+    burst_bytes = 0;
+    burst_queued = 0;
+    burst_rest = 0;
 }
 
 // Set shift direction. (MSB_FIRST or LSB_FIRST)
@@ -147,16 +185,219 @@ uint8 `$INSTANCE_NAME`_TAP_Get_State(void) {
 
 // clang-format on
 
+// Drive TRST. The Cmd register bit 7 is TRST, and the other bits are left as they are.
+void `$INSTANCE_NAME`_Set_TRST(uint8 on) {
+    if (on) {
+        `$INSTANCE_NAME`_Cmd |= 0x80;
+    } else {
+        `$INSTANCE_NAME`_Cmd &= ~0x80;
+    }
+}
+
+// Return CPU cycles spent waiting for the datapath. They are counted by DWT CYCCNT,
+// so they stay 0 unless the cycle counter is enabled.
+uint32 `$INSTANCE_NAME`_Get_Wait_Cycles(void) {
+    return wait_cycles;
+}
+
 // Shift TDI out, read TDO in, then retrun TDO bits.
 uint8 `$INSTANCE_NAME`_TAP_Scan(uint8 count_minus1, uint8 out_bits, uint8 last_tms) {
     uint8 count = count_minus1 + 1;
-    uint8 bits = (Shift_Dir == MSB_FIRST) ? out_bits : bit_reversal[out_bits];
+    uint8 bits = (Shift_Dir == MSB_FIRST) ? out_bits : REVERSE8(out_bits);
     uint8 ret = run_cmd(count | CMD_TDI | ((last_tms) ? CMD_LAST_TMS : 0), bits);
     if (last_tms) {
         TAP_State += 1;
     }
-    return (Shift_Dir == MSB_FIRST) ? ret : (bit_reversal[ret] >> (8 - count));
+    return (Shift_Dir == MSB_FIRST) ? ret : (REVERSE8(ret) >> (8 - count));
+}
+
+// Shift TDI bytes out, read TDO bytes in. in_bytes may be NULL to discard TDO.
+// Full bytes are queued up to FIFO_DEPTH deep so that TCK keeps running while
+// TDO is collected, by DMA from DMA_MIN_BYTES if the DMA components are placed.
+// The last partial byte and the last TMS are done by TAP_Scan.
+void `$INSTANCE_NAME`_TAP_Scan_Bytes(uint32 bit_count, const uint8 *out_bytes, uint8 *in_bytes, uint8 last_tms) {
+    uint32 full = bit_count / 8;
+    uint8 rest = bit_count % 8;
+    uint8 inBits;
+
+    if (last_tms && rest == 0 && full > 0) {
+        full--;
+        rest = 8;
+    }
+#if defined(`$INSTANCE_NAME`_DMA)
+    if (full >= DMA_MIN_BYTES) {
+        shift_bytes_dma(full, out_bytes, in_bytes, Shift_Dir == LSB_FIRST);
+    } else
+#endif
+    {
+        shift_bytes(8 | CMD_TDI, full, out_bytes, in_bytes, Shift_Dir == LSB_FIRST);
+    }
+    if (rest > 0) {
+        inBits = `$INSTANCE_NAME`_TAP_Scan(rest - 1, out_bytes[full], last_tms);
+        if (in_bytes != NULL) {
+            in_bytes[full] = inBits;
+        }
+    }
+}
+
+// Clock the packed TMS bits (LSB of each byte first), and follow the TAP state.
+// TDI is held low, as the datapath drives it only in TDI mode.
+void `$INSTANCE_NAME`_TAP_TMS_Sequence(uint32 bit_count, const uint8 *tms_bytes) {
+    uint32 full = bit_count / 8;
+    uint8 rest = bit_count % 8;
+    uint32 i;
+
+    shift_bytes(8 | CMD_TMS, full, tms_bytes, NULL, 1);
+    if (rest > 0) {
+        run_cmd(rest | CMD_TMS, REVERSE8(tms_bytes[full]));
+    }
+    for (i = 0; i < bit_count; i++) {
+        TAP_State = tap_next[TAP_State][(tms_bytes[i / 8] >> (i % 8)) & 1];
+    }
+}
+
+// Start clock_count TCK cycles with TMS and TDI low, and return without waiting.
+// The datapath re-arms itself for each byte in F0, so the burst runs while the
+// CPU is doing other work, as long as Clock_Burst_Poll() tops up F0 in time.
+// Other APIs must not be called until Clock_Burst_Poll() returns 0.
+void `$INSTANCE_NAME`_Clock_Burst_Start(uint32 clock_count) {
+    while (`$INSTANCE_NAME`_Stat & STAT_DONE) {
+        (void)`$INSTANCE_NAME`_InBits; // clear FIFO
+    }
+    burst_bytes = clock_count / 8;
+    burst_queued = 0;
+    burst_rest = clock_count % 8;
+    `$INSTANCE_NAME`_Cmd = 8 | CMD_TDI;
+    `$INSTANCE_NAME`_Clock_Burst_Poll();
+}
+
+// Keep the clock burst running. Return non-zero while it is in progress.
+uint8 `$INSTANCE_NAME`_Clock_Burst_Poll(void) {
+    while (`$INSTANCE_NAME`_Stat & STAT_DONE) {
+        (void)`$INSTANCE_NAME`_InBits;
+        burst_queued--;
+    }
+    while (burst_bytes > 0 && burst_queued < FIFO_DEPTH) {
+        `$INSTANCE_NAME`_OutBits = 0;
+        burst_bytes--;
+        burst_queued++;
+    }
+    if (burst_bytes > 0 || burst_queued > 0) {
+        return 1;
+    }
+    if (burst_rest > 0) {
+        run_cmd(burst_rest | CMD_TDI, 0);
+        burst_rest = 0;
+    }
+    return 0;
+}
+
+// Shift count full bytes in the given mode. Bytes are queued up to FIFO_DEPTH deep.
+// Data is loaded, bit reversed and stored a 32-bit word (4 bytes) at a time.
+static void shift_bytes(uint8 cmd, uint32 count, const uint8 *out_bytes, uint8 *in_bytes, uint8 lsb_first) {
+    uint32 sent = 0;
+    uint32 recv = 0;
+    uint32 out_word = 0;
+    uint32 in_word = 0;
+    uint8 n;
+    uint32 start;
+
+    if (count == 0) {
+        return;
+    }
+    while (`$INSTANCE_NAME`_Stat & STAT_DONE) {
+        (void)`$INSTANCE_NAME`_InBits; // clear FIFO
+    }
+    `$INSTANCE_NAME`_Cmd = cmd;
+    while (recv < count) {
+        if (sent < count && sent - recv < FIFO_DEPTH) {
+            if ((sent & 3) == 0) {
+                n = (count - sent < 4) ? count - sent : 4;
+                out_word = 0;
+                memcpy(&out_word, out_bytes + sent, n);
+                out_word = lsb_first ? REVERSE8X4(out_word) : out_word;
+            }
+            `$INSTANCE_NAME`_OutBits = out_word & 0xff;
+            out_word >>= 8;
+            sent++;
+        } else if (!(`$INSTANCE_NAME`_Stat & STAT_DONE)) {
+            // Nothing to feed: only this wait for the next TDO byte is counted.
+            start = DWT->CYCCNT;
+            while (!(`$INSTANCE_NAME`_Stat & STAT_DONE)) {
+            }
+            wait_cycles += DWT->CYCCNT - start;
+        }
+        if (`$INSTANCE_NAME`_Stat & STAT_DONE) {
+            in_word |= (uint32)`$INSTANCE_NAME`_InBits << ((recv & 3) * 8);
+            recv++;
+            if ((recv & 3) == 0 || recv == count) {
+                n = ((recv - 1) & 3) + 1;
+                in_word = lsb_first ? REVERSE8X4(in_word) : in_word;
+                if (in_bytes != NULL) {
+                    memcpy(in_bytes + recv - n, &in_word, n);
+                }
+                in_word = 0;
+            }
+        }
+    }
+}
+
+#if defined(`$INSTANCE_NAME`_DMA)
+// Reverse the bits of each of count bytes, a word at a time. dst may be src.
+static void reverse_bytes(uint8 *dst, const uint8 *src, uint32 count) {
+    uint32 word;
+    uint32 k;
+    uint8 n;
+    for (k = 0; k < count; k += 4) {
+        n = (count - k < 4) ? count - k : 4;
+        word = 0;
+        memcpy(&word, src + k, n);
+        word = REVERSE8X4(word);
+        memcpy(dst + k, &word, n);
+    }
+}
+
+// Shift count full bytes in TDI mode by DMA. DMA_TX feeds F0 while it is not full,
+// and DMA_RX empties F1 while it is not empty, so the CPU only waits for DMA_RX.
+// In LSB first mode, TDI is bit reversed into dma_tdi and TDO in place, a chunk at a time.
+static void shift_bytes_dma(uint32 count, const uint8 *out_bytes, uint8 *in_bytes, uint8 lsb_first) {
+    uint32 done;
+    uint16 n;
+    const uint8 *src;
+    uint8 state;
+    uint32 start;
+
+    while (`$INSTANCE_NAME`_Stat & STAT_DONE) {
+        (void)`$INSTANCE_NAME`_InBits; // clear FIFO
+    }
+    `$INSTANCE_NAME`_Cmd = 8 | CMD_TDI;
+    for (done = 0; done < count; done += n) {
+        n = (count - done < DMA_CHUNK) ? count - done : DMA_CHUNK;
+        src = out_bytes + done;
+        if (lsb_first) {
+            reverse_bytes(dma_tdi, src, n);
+            src = dma_tdi;
+        }
+        CyDmaTdSetConfiguration(dma_rx_td, n, CY_DMA_DISABLE_TD, (in_bytes != NULL) ? CY_DMA_TD_INC_DST_ADR : 0);
+        CyDmaTdSetAddress(dma_rx_td, `$INSTANCE_NAME`_DMA_ADDR(`$INSTANCE_NAME`_Datapath_1_F1_PTR),
+                          `$INSTANCE_NAME`_DMA_ADDR((in_bytes != NULL) ? in_bytes + done : &dma_discard));
+        CyDmaChSetInitialTd(dma_rx_ch, dma_rx_td);
+        CyDmaChEnable(dma_rx_ch, 1);
+        CyDmaTdSetConfiguration(dma_tx_td, n, CY_DMA_DISABLE_TD, CY_DMA_TD_INC_SRC_ADR);
+        CyDmaTdSetAddress(dma_tx_td, `$INSTANCE_NAME`_DMA_ADDR(src), `$INSTANCE_NAME`_DMA_ADDR(`$INSTANCE_NAME`_Datapath_1_F0_PTR));
+        CyDmaChSetInitialTd(dma_tx_ch, dma_tx_td);
+        CyDmaChEnable(dma_tx_ch, 1);
+        start = DWT->CYCCNT;
+        do {
+            CyDmaChStatus(dma_rx_ch, NULL, &state);
+        } while (state & CY_DMA_STATUS_CHAIN_ACTIVE);
+        wait_cycles += DWT->CYCCNT - start;
+        if (lsb_first && in_bytes != NULL) {
+            reverse_bytes(in_bytes + done, in_bytes + done, n);
+        }
+    }
 }
+#endif
 
 static uint8 run_cmd(uint8 cmd_count, uint8 outBits) {
     uint8 inBits;
@@ -165,8 +406,10 @@ static uint8 run_cmd(uint8 cmd_count, uint8 outBits) {
     }
     `$INSTANCE_NAME`_Cmd = cmd_count;
     `$INSTANCE_NAME`_OutBits = outBits;
+    uint32 start = DWT->CYCCNT;
     while (!(`$INSTANCE_NAME`_Stat & STAT_DONE)) {
     }
+    wait_cycles += DWT->CYCCNT - start;
     inBits = `$INSTANCE_NAME`_InBits;
     return inBits;
 }
@@ -35,6 +35,12 @@ void `$INSTANCE_NAME`_TAP_Reset(void);
 void `$INSTANCE_NAME`_TAP_Move(uint8 new_state);
 uint8 `$INSTANCE_NAME`_TAP_Get_State(void);
 uint8 `$INSTANCE_NAME`_TAP_Scan(uint8 count, uint8 out_bits, uint8 last_tms);
+void `$INSTANCE_NAME`_TAP_Scan_Bytes(uint32 bit_count, const uint8 *out_bytes, uint8 *in_bytes, uint8 last_tms);
+void `$INSTANCE_NAME`_TAP_TMS_Sequence(uint32 bit_count, const uint8 *tms_bytes);
+void `$INSTANCE_NAME`_Clock_Burst_Start(uint32 clock_count);
+uint8 `$INSTANCE_NAME`_Clock_Burst_Poll(void);
+void `$INSTANCE_NAME`_Set_TRST(uint8 on);
+uint32 `$INSTANCE_NAME`_Get_Wait_Cycles(void);
 
 #endif
 
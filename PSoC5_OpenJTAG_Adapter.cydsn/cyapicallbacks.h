@@ -16,6 +16,22 @@
 /*For more information, refer to the Writing Code topic in the PSoC Creator Help.*/
 #define USBFS_HANDLE_VENDOR_RQST_CALLBACK
 uint8 USBFS_HandleVendorRqst_Callback(void);
+#define USBFS_EP_1_ISR_EXIT_CALLBACK
+void USBFS_EP_1_ISR_ExitCallback(void);
+#define USBFS_EP_2_ISR_EXIT_CALLBACK
+void USBFS_EP_2_ISR_ExitCallback(void);
+#define USBFS_EP_3_ISR_EXIT_CALLBACK
+void USBFS_EP_3_ISR_ExitCallback(void);
+#define USBFS_EP_4_ISR_EXIT_CALLBACK
+void USBFS_EP_4_ISR_ExitCallback(void);
+#define USBFS_EP_5_ISR_EXIT_CALLBACK
+void USBFS_EP_5_ISR_ExitCallback(void);
+#define USBFS_EP_6_ISR_EXIT_CALLBACK
+void USBFS_EP_6_ISR_ExitCallback(void);
+#define USBFS_EP_7_ISR_EXIT_CALLBACK
+void USBFS_EP_7_ISR_ExitCallback(void);
+#define USBFS_EP_8_ISR_EXIT_CALLBACK
+void USBFS_EP_8_ISR_ExitCallback(void);
 
 #endif /* CYAPICALLBACKS_H */
 /* [] */
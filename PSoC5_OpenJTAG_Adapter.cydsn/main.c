@@ -5,13 +5,16 @@
 
 #include <project.h>
 #include <stdio.h>
+#include <string.h>
 
 /**************************************
  * Macros
  *************************************/
 #define VTREF_THRESHOLD (2.9f)
+#define VTREF_HYSTERESIS (0.05f) // keeps ADC noise from toggling target power
 #define MIN(x, y) ((x < y) ? x : y)
 #define MAX(x, y) ((x > y) ? x : y)
+#define CLK_JTAG_KHZ (76000u) // TCK is CLK_JTAG_KHZ / CLK_JTAG_div
 
 // USBFS
 // ----------------------------------------------------------------------
@@ -19,13 +22,249 @@
 #define IN_EP_NUM (1u)
 #define OUT_EP_NUM (2u)
 #define EP_SIZE (64u)
-#define BUFFER_SIZE (512u)
-uint8 InEP_buf[BUFFER_SIZE];
-uint8 OutEP_buf[BUFFER_SIZE];
-uint16 InEP_buf_idx = 0;
-uint16 OutEP_buf_len = 0;
-volatile int16 USB_Read_Request_Len = 0;
-volatile int16 USB_Write_Request_Len = 0;
+#define BUFFER_SIZE (1024u)   // InEP buffer
+#define OUT_RING_SLOTS (8u)    // must be a power of 2
+#define OUT_RING_EMPTY(ch) ((ch)->OutEP_ring_head == (ch)->OutEP_ring_tail)
+#define OUT_RING_FULL(ch) ((uint8)((ch)->OutEP_ring_head - (ch)->OutEP_ring_tail) == OUT_RING_SLOTS)
+
+// Session options, set by wValue of JTAG_ENABLE.
+#define SESSION_FRAMED (1u << 0) // self-framed bulk protocol
+#define SESSION_RLE (1u << 1)    // run-length encoded responses (with SESSION_FRAMED)
+
+// Self-framed bulk protocol
+// ----------------------------------------------------------------------
+// Each OUT frame is a header (payload length (16 bits), sequence, flags) and
+// the command bytes. When the commands are executed, the response is sent as
+// a header (TDO length (16 bits), sequence, status) and the TDO bytes,
+// without JTAG_WRITE/JTAG_READ requests. A response longer than InEP buffer
+// is sent in chunks, each with its own header.
+#define FRAME_HDR_SIZE (4u)
+#define FRAME_STAT_OVERFLOW (1u << 0) // some TDO bytes were lost
+#define FRAME_STAT_RLE (1u << 1)      // TDO bytes are run-length encoded
+#define FRAME_STAT_MORE (1u << 2)     // the response continues in the next chunk
+
+// Run-length encoding of responses (SESSION_RLE)
+// ----------------------------------------------------------------------
+// Control byte 0x00-0x7f: 1-128 literal bytes follow.
+// Control byte 0x80-0xff: the next byte is repeated 3-130 times.
+// Each chunk of a response is sent encoded only if it gets shorter. (decoded by tools/rle.py)
+#define RLE_MAX_LITERAL (128u)
+#define RLE_MIN_RUN (3u)
+#define RLE_MAX_RUN (130u)
+uint8 rle_buf[BUFFER_SIZE];
+
+// Command parser
+// ----------------------------------------------------------------------
+typedef enum { PARSE_CMD, PARSE_HEADER, PARSE_DATA, PARSE_XSVF, PARSE_MEMAP, PARSE_TMS, PARSE_MACRO } PARSE_STATE;
+typedef struct {
+    PARSE_STATE state;
+    uint8 cmd, arg;
+    uint8 hdr[12];
+    uint8 hdr_len, hdr_idx;
+    uint32 bits_left; // TDI (or TMS) bits of a long shift still to come
+    uint32 bit_pos;   // TDI bits of a long shift already scanned
+    uint32 mismatch;  // first mismatching bit of a compared shift, or CMP_PASS
+    uint32 xsvf_left; // XSVF bytes of the chunk still to come
+    uint8 end_state;  // TAP state to move to after a long shift, or TAP_STATE_NONE
+    uint8 macro_id;   // macro being defined
+    uint8 macro_left; // bytes of the macro body still to come
+} PARSER;
+#define TAP_STATE_NONE (0xffu)
+#define CMP_PASS (0xffffffffu)
+#define CMP_CHUNK (32u) // bytes compared at once
+
+// XSVF player
+// ----------------------------------------------------------------------
+// Vectors are kept in fixed buffers, so RAM usage does not depend on the file size.
+// XSVF stores a vector from the byte shifted last, so TDI is read whole before it is
+// shifted. TDO is captured and compared a chunk at a time, and needs no buffer.
+#define XSVF_MAX_BYTES (2048u) // longest vector (16384 bits)
+typedef enum { XSVF_OK, XSVF_DONE, XSVF_ERR_TDO, XSVF_ERR_UNSUPPORTED, XSVF_ERR_SIZE } XSVF_STATUS;
+typedef struct {
+    uint8 status;        // XSVF_STATUS
+    uint8 inst;          // instruction being read, or XSVF_NONE
+    uint8 field;         // operand being read
+    uint8 *dest;         // where the operand goes
+    uint16 len, idx;     // operand length and position
+    uint8 reverse;       // operand is a vector, stored from the last byte
+    uint8 arg[6];        // scalar operands (big-endian)
+    uint32 sdr_bits;     // XSDRSIZE
+    uint32 runtest;      // XRUNTEST (us)
+    uint8 repeat;        // XREPEAT
+    uint8 endir, enddr;  // XENDIR, XENDDR (TAP state)
+    uint32 inst_count;   // instructions done
+    uint8 tdi[XSVF_MAX_BYTES];
+    uint8 tdo_exp[XSVF_MAX_BYTES];
+    uint8 tdo_mask[XSVF_MAX_BYTES];
+} XSVF_PLAYER;
+#define XSVF_NONE (0xffu)
+
+// ARM JTAG-DP
+// ----------------------------------------------------------------------
+#define DAP_IR_DPACC (0x0a)
+#define DAP_IR_APACC (0x0b)
+#define DAP_IR_UNKNOWN (0xff)
+#define DAP_ACK_WAIT (1u)
+#define DAP_ACK_OK (2u)
+#define DAP_RDBUFF (0x0c)
+#define DAP_WAIT_LIMIT (100u) // default retries of a transaction answered with WAIT
+#define DP_SELECT (0x08)
+#define AP_CSW (0x00)
+#define AP_TAR (0x04)
+#define AP_DRW (0x0c)
+#define MEMAP_CSW (0x23000052u) // 32-bit, single auto-increment, debug master
+#define MEMAP_TAR_WRAP (0x400u) // TAR auto-increment is only guaranteed within 1KB
+typedef struct {
+    uint32 addr;
+    uint16 left, done; // words
+    uint8 ack;
+    uint8 tar_valid;
+    uint8 word[4];
+    uint8 word_idx;
+} MEMAP;
+
+// Macros
+// ----------------------------------------------------------------------
+// Command sequences stored by CMD 15, and run by ID with argument bytes patched
+// into the body. A macro can be repeated until a TDO bit of its output matches.
+#define MACRO_SLOTS (8u)
+#define MACRO_MAX_BYTES (128u)
+#define MACRO_ARGS (4u)
+#define MACRO_PARAM_NONE (0xffu)
+typedef enum { MACRO_OK, MACRO_ERR_ID, MACRO_ERR_TIMEOUT, MACRO_ERR_BODY } MACRO_STATUS;
+typedef struct {
+    uint8 len;                // 0 if not defined
+    uint8 param[MACRO_ARGS];  // body offset of each argument byte, or MACRO_PARAM_NONE
+    uint8 body[MACRO_MAX_BYTES];
+} MACRO;
+
+// Channels
+// ----------------------------------------------------------------------
+// A channel is a JTAG chain and the USB interface which drives it. The commands and
+// the USB helpers work on the channel given to them, and nothing of a command stream
+// is kept outside of it.
+// The components of a chain are reached through JTAG_CHAIN, since PSoC Creator
+// generates their APIs under the instance names.
+typedef struct {
+    void (*Start)(void);
+    void (*Reset)(void);
+    void (*Set_Shift_Dir)(uint8 dir);
+    uint8 (*Get_Shift_Dir)(void);
+    void (*TAP_Reset)(void);
+    void (*TAP_Move)(uint8 new_state);
+    uint8 (*TAP_Get_State)(void);
+    uint8 (*TAP_Scan)(uint8 count, uint8 out_bits, uint8 last_tms);
+    void (*TAP_Scan_Bytes)(uint32 bit_count, const uint8 *out_bytes, uint8 *in_bytes, uint8 last_tms);
+    void (*TAP_TMS_Sequence)(uint32 bit_count, const uint8 *tms_bytes);
+    void (*Clock_Burst_Start)(uint32 clock_count);
+    uint8 (*Clock_Burst_Poll)(void);
+    void (*Set_TRST)(uint8 on);
+    uint32 (*Get_Wait_Cycles)(void);
+    void (*Clock_SetDividerValue)(uint16 div); // TCK clock
+    uint16 (*Clock_GetDividerRegister)(void);
+} JTAG_CHAIN;
+
+typedef struct {
+    const JTAG_CHAIN *jtag;
+    uint8 in_ep, out_ep;
+    uint16 clk_div; // TCK is CLK_JTAG_KHZ / clk_div
+
+    uint8 InEP_buf[BUFFER_SIZE];
+    volatile uint16 InEP_buf_idx;
+    volatile uint16 InEP_buf_sent; // loaded into IN EP
+    volatile uint16 InEP_end;      // end of the response being sent
+    volatile uint8 InEP_closed;    // no more results are added to the response
+    volatile uint8 InEP_done;      // last packet of the response is loaded
+    uint16 InEP_reserved;          // reserved by USBFS_reserve()
+    uint32 usb_in_overflow;        // TDO bytes lost by InEP buffer overflow
+    volatile uint32 USB_Read_Request_Len;
+    volatile uint32 USB_Write_Request_Len;
+
+    // Ring of received OUT packets. Filled by the OUT EP ISR, consumed by loop().
+    uint8 OutEP_ring[OUT_RING_SLOTS][EP_SIZE];
+    uint8 OutEP_ring_len[OUT_RING_SLOTS];
+    uint32 OutEP_ring_time[OUT_RING_SLOTS];
+    volatile uint8 OutEP_ring_head;
+    volatile uint8 OutEP_ring_tail;
+    uint8 OutEP_ring_pos; // bytes of the tail slot already consumed
+
+    volatile uint16 session_flags;
+    uint8 rti_burst; // CMD 9 clock burst is running
+
+    uint8 frame_hdr[FRAME_HDR_SIZE];
+    uint8 frame_hdr_idx;
+    uint16 frame_left;          // payload bytes of the current frame still to come
+    volatile uint8 frame_ready; // frame is executed, and its response waits to be closed
+    uint16 frame_resp_pos;      // position of the response header in InEP buffer
+    uint32 frame_overflow_base;
+
+    PARSER *parser;      // host_parser, or macro_parser while a macro runs
+    PARSER host_parser;  // commands from the host
+    PARSER macro_parser; // a macro body, so that the command running it is kept intact
+    XSVF_PLAYER xsvf;
+    MEMAP memap;
+    uint8 dap_ir;          // IR last scanned by the DAP commands
+    uint16 dap_wait_limit; // retries of a transaction answered with WAIT
+    MACRO macros[MACRO_SLOTS];
+    uint8 macro_running;
+    uint8 macro_abort; // a command not allowed in a macro stops it
+
+    uint32 perf_resp_start;         // arrival of the first OUT packet of the open response
+    uint8 perf_resp_valid;
+    uint32 perf_closed_start;       // the same of the closed response
+    uint8 perf_closed_valid;
+    volatile uint32 InEP_done_time; // when the last packet of the response is loaded
+} CHANNEL;
+
+// Components of each chain in TopDesign, and the bulk EP pair of its USB interface.
+// Vendor requests select the channel by wIndex.
+const JTAG_CHAIN chains[] = {
+    {JTAG_Start, JTAG_Reset, JTAG_Set_Shift_Dir, JTAG_Get_Shift_Dir, JTAG_TAP_Reset, JTAG_TAP_Move, JTAG_TAP_Get_State, JTAG_TAP_Scan,
+     JTAG_TAP_Scan_Bytes, JTAG_TAP_TMS_Sequence, JTAG_Clock_Burst_Start, JTAG_Clock_Burst_Poll, JTAG_Set_TRST, JTAG_Get_Wait_Cycles,
+     CLK_JTAG_SetDividerValue, CLK_JTAG_GetDividerRegister},
+};
+#define CHANNEL_INIT(chain, in_ep_num, out_ep_num)                                                                                                   \
+    {.jtag = (chain), .in_ep = (in_ep_num), .out_ep = (out_ep_num), .dap_ir = DAP_IR_UNKNOWN, .dap_wait_limit = DAP_WAIT_LIMIT,                        \
+     .xsvf = {XSVF_DONE, XSVF_NONE}}
+CHANNEL channels[] = {CHANNEL_INIT(&chains[0], IN_EP_NUM, OUT_EP_NUM)};
+#define CHANNELS (sizeof(channels) / sizeof(channels[0]))
+
+// TCK calibration
+// ----------------------------------------------------------------------
+// Each divider is tried with IDCODE reads and BYPASS loopbacks of pseudo-random bits,
+// from the fastest one. Each step slows TCK by about 1/4.
+#define CAL_MAX_SPEEDS (48u)
+#define CAL_PRBS_BYTES (8u) // bits per loopback, in bytes
+#define CAL_MAX_TAPS (64u)  // longest chain whose BYPASS length can be found
+#define CAL_IR_BYTES (32u)  // ones shifted into the IR chain to select BYPASS
+typedef enum { CAL_OK, CAL_ERR_NONE, CAL_ERR_CHAIN } CAL_STATUS;
+uint16 cal_div[CAL_MAX_SPEEDS];
+uint8 cal_errors[CAL_MAX_SPEEDS]; // failed iterations at each divider
+uint32 cal_prbs = 0x2545f491u;    // xorshift state
+
+// Performance counters
+// ----------------------------------------------------------------------
+// Counted by DWT CYCCNT, and read by JTAG_PERF vendor request. Bucket n of the
+// latency histograms counts latencies of 2^n to 2^(n+1)-1 us. (bucket 0 is < 2us)
+#define PERF_BUCKETS (16u)
+typedef struct {
+    uint32 cycles;                      // since reset
+    uint32 cmd_count[16];               // by command, with the commands of a macro in its CMD 15
+    uint32 cmd_cycles[16];              // parsing and executing each command, with its data
+    uint32 out_bytes;                   // received
+    uint32 in_bytes;                    // pushed to InEP buffer
+    uint32 in_overflow;                 // TDO bytes lost by InEP buffer overflow
+    uint32 bits;                        // shifted
+    uint32 jtag_wait_cycles;            // polling the JTAG datapath for TDO
+    uint32 out_wait_cycles;             // main loop with no OUT packet to execute
+    uint32 send_cycles;                 // in USBFS_send()
+    uint32 queue_latency[PERF_BUCKETS]; // OUT packet arrival to its execution
+    uint32 resp_latency[PERF_BUCKETS];  // first OUT packet of a response to its last IN packet
+} PERF;
+PERF perf;
+PERF perf_report;     // snapshot sent to the host
+uint32 perf_last;     // CYCCNT at the last update of perf.cycles
+uint32 perf_base[4];  // stat_bits, stat_in_bytes, JTAG wait cycles and overflow at reset
 
 // Status LED
 // ----------------------------------------------------------------------
@@ -37,7 +276,7 @@ typedef enum { OffLine, OnLine, ActIn, ActOut } STATUS;
 #define DP_ENABLE 1
 #if defined(DP_ENABLE)
 char print_buf[256];
-#define DP(...) {sprintf(print_buf, __VA_ARGS__);UART_KitProg_PutString(print_buf);}
+#define DP(...) {trace_finish();sprintf(print_buf, __VA_ARGS__);UART_KitProg_PutString(print_buf);}
 #else
 #define DP(...)
 #endif
@@ -62,17 +301,65 @@ char print_buf[256];
 #else
 #define DP4(...)
 #endif
+
+// Binary trace, drained to UART in background and decoded by tools/trace_decode.py.
+#define TRACE_ENABLE 1
+#if defined(TRACE_ENABLE)
+#define TRACE(id, a0, a1, a2) trace_put(id, a0, a1, a2)
+#else
+#define TRACE(...)
+#endif
 // clang-format on
 
+// Trace event IDs. Keep in sync with tools/trace_decode.py.
+typedef enum {
+    TR_LOST = 1,      // a0-a1: number of lost events
+    TR_SET_CLOCK,     // a0-a1: clock divider
+    TR_TAP_RESET,     //
+    TR_HW_RESET,      //
+    TR_SHIFT_DIR,     // a0: LSB(1)/MSB(0)
+    TR_VTREF,         // a0-a1: VTref in mV
+    TR_TARGET_POWER,  // a0: on(1)/off(0)
+    TR_IN_OVERFLOW,   // a0-a1: InEP buffer index
+    TR_XSVF_ERROR,    // a0: status, a1: instruction
+} TRACE_EVENT;
+
+// Trace record: sync, event ID, 3 argument bytes, Timer_1 counter (16 bits), tick count (low 8 bits).
+#define TRACE_SYNC (0xA5)
+#define TRACE_REC_SIZE (8u)
+#define TRACE_RECS (64u) // must be a power of 2
+uint8 trace_buf[TRACE_RECS][TRACE_REC_SIZE];
+uint8 trace_head = 0;
+uint8 trace_tail = 0;
+uint8 trace_pos = 0; // byte position in the record being drained
+uint16 trace_lost = 0;
+
 /**************************************
  * Variables
  *************************************/
 volatile uint16 count = 0;
-uint16 last_count = 0;
 uint16 PWM_clock_divider;
 uint8 tPwr = 255;
 char Bin_Buf[17];
 
+// VTref threshold, compared in ADC counts by Slow_Tick_ISR.
+int32 vtref_on_counts;
+int32 vtref_off_counts;
+volatile int32 vtref_counts;
+volatile uint8 vtref_pwr = 0;   // target power detected by Slow_Tick_ISR
+volatile uint8 vtref_event = 1; // vtref_pwr changed, or not applied yet
+
+// Console commands, received from UART by Slow_Tick_ISR.
+#define CONSOLE_QUEUE_SIZE (16u) // power of 2
+volatile uint8 console_queue[CONSOLE_QUEUE_SIZE];
+volatile uint8 console_head = 0;
+uint8 console_tail = 0;
+
+// Command statistics, counted by exec_command().
+uint32 stat_cmds = 0;
+uint32 stat_bits = 0;
+uint32 stat_in_bytes = 0;
+
 char *Tap_Desc[16] = {"TestLogicReset", "RunTestIdle", "Sel-DR", "Cap-DR",   "Shift-DR", "Exit1-DR", "Pause-DR", "Exit2-DR",
                       "Update-DR",      "Sel-IR",      "Cap-IR", "Shift-IR", "Exit1-IR", "Pause-IR", "Exit2-IR", "Update-IR"};
 
@@ -82,11 +369,59 @@ char *Tap_Desc[16] = {"TestLogicReset", "RunTestIdle", "Sel-DR", "Cap-DR",   "Sh
 void setStatus(STATUS status);
 void loop(void);
 void init_bit_reversal_table(void);
-static void USBFS_push_byte(uint8 b);
-static int USBFS_send(void);
+static void channel_reset(CHANNEL *ch);
+static int channel_poll(CHANNEL *ch);
+static void USBFS_receive(CHANNEL *ch);
+static uint16 frame_input(CHANNEL *ch, const uint8 *buf, uint16 len);
+static void frame_open(CHANNEL *ch);
+static void frame_close(CHANNEL *ch, uint8 status);
+static uint8 frame_continue(CHANNEL *ch, uint16 len);
+static uint16 rle_encode(const uint8 *in, uint16 len, uint8 *out, uint16 max);
+static uint16 parse_commands(CHANNEL *ch, const uint8 *buf, uint16 len);
+static void exec_command(CHANNEL *ch);
+static uint16 scan_compare(CHANNEL *ch, const uint8 *buf, uint16 len);
+static void compare_bytes(CHANNEL *ch, const uint8 *triplets, uint16 count);
+static void shift_start(CHANNEL *ch, uint32 bits);
+static void shift_end(CHANNEL *ch);
+static uint32 get_le(const uint8 *buf, uint8 len);
+static void set_clock_divider(CHANNEL *ch, uint16 div);
+static uint16 khz_to_divider(uint32 khz);
+static void USBFS_push_byte(CHANNEL *ch, uint8 b);
+static void USBFS_push_le(CHANNEL *ch, uint32 val, uint8 len);
+static uint8 *USBFS_reserve(CHANNEL *ch, uint16 len);
+static uint8 USBFS_make_room(CHANNEL *ch, uint16 len);
+static uint8 USBFS_flush(CHANNEL *ch);
+static void USBFS_reclaim(CHANNEL *ch);
+static void USBFS_commit(CHANNEL *ch);
+static void USBFS_overflow(CHANNEL *ch, uint16 len);
+static void USBFS_load_next(CHANNEL *ch);
+static int USBFS_send(CHANNEL *ch);
+static void vtref_init(void);
 static void check_VTref(void);
+static void console_command(uint8 c);
+static uint8 console_jtag_busy(CHANNEL *ch);
 static void Set_Internal_Power(uint8 on_off);
 static char *toBin(uint8 b, int len);
+static void run_benchmark(CHANNEL *ch);
+static void cycle_counter_start(void);
+static void perf_reset(void);
+static uint32 jtag_wait_cycles(void);
+static uint32 in_overflow_bytes(void);
+static void perf_latency(uint32 *hist, uint32 cycles);
+static uint8 dap_transfer(CHANNEL *ch, uint8 ap, uint8 rnw, uint8 addr, uint32 *data);
+static void memap_start(CHANNEL *ch, uint8 ap, uint32 addr, uint16 count);
+static void memap_read(CHANNEL *ch);
+static uint16 memap_write(CHANNEL *ch, const uint8 *buf, uint16 len);
+static void memap_finish(CHANNEL *ch, uint8 write);
+static void xsvf_start(CHANNEL *ch);
+static uint16 macro_define(CHANNEL *ch, const uint8 *buf, uint16 len);
+static uint8 macro_run(CHANNEL *ch, uint8 id, const uint8 *args);
+static void macro_poll(CHANNEL *ch, const uint8 *hdr);
+static void tck_calibrate(CHANNEL *ch, uint16 fastest, uint16 slowest, uint8 iterations);
+static uint16 xsvf_input(CHANNEL *ch, const uint8 *buf, uint16 len);
+static void trace_put(uint8 id, uint8 a0, uint8 a1, uint8 a2);
+static void trace_drain(void);
+static void trace_finish(void);
 CY_ISR_PROTO(Slow_Tick_ISR);
 
 /**************************************
@@ -94,21 +429,31 @@ CY_ISR_PROTO(Slow_Tick_ISR);
  *************************************/
 uint8 work_out_bits;
 uint8 work_RTI_count;
+uint32 work_RTI_clocks;
+uint32 work_clock_hz;
+uint32 work_dap_data;
 int main() {
+    uint8 c;
     CyGlobalIntEnable;
 
     /* Start components. */
     USBFS_Start(USBFS_DEVICE, USBFS_5V_OPERATION);
     AMux_Start();
     Set_Internal_Power(0);
-    JTAG_Start();
+    for (c = 0; c < CHANNELS; c++) {
+        channels[c].jtag->Start();
+        channels[c].clk_div = channels[c].jtag->Clock_GetDividerRegister() + 1;
+    }
     UART_KitProg_Start();
     PWM_LED_Start();
     ADC_Start();
+    vtref_init();
     ADC_StartConvert();
     Timer_1_Start();
     isr_1_StartEx(Slow_Tick_ISR);
     PWM_clock_divider = CLK_PWM_GetDividerRegister();
+    cycle_counter_start();
+    perf_reset();
 
     DP("\n\n----------------------------------------\n");
     DP("Hello, PSoC5LP OpenJTAG Adapter.\n");
@@ -117,75 +462,68 @@ int main() {
     DP("'e' - External power mode.\n");
     DP("'r' - Reset the target by TRST.\n");
     DP("'t' - Signal test for wave form analysis.\n");
+    DP("'b' - Benchmark the command interpreter with canned OpenOCD traffic.\n");
     DP("\nExternal power mode.\n");
 
     for (;;) {
         setStatus(OffLine);
         DP("\nWait for enumeration.\n")
         while (0u == USBFS_GetConfiguration()) {
-            check_VTref();
+            if (vtref_event) {
+                check_VTref();
+            }
+            if (console_tail != console_head) {
+                console_tail++; /* Ignore until enumerated. */
+            }
         }
         DP("Enumerated by host.\n");
 
-        // Init JTAG and USB buffers
-        JTAG_Reset();
-        USB_Read_Request_Len = 0;
-        USB_Write_Request_Len = 0;
-        InEP_buf_idx = 0;
-        OutEP_buf_len = 0;
-
+        for (c = 0; c < CHANNELS; c++) {
+            channel_reset(&channels[c]);
+        }
         setStatus(OnLine);
-        USBFS_EnableOutEP(OUT_EP_NUM);
         loop();
         DP("Connection lost.\n");
     }
 }
 
+// Init JTAG and USB buffers of the channel at enumeration.
+static void channel_reset(CHANNEL *ch) {
+    ch->jtag->Reset();
+    ch->USB_Read_Request_Len = 0;
+    ch->USB_Write_Request_Len = 0;
+    ch->InEP_buf_idx = 0;
+    ch->InEP_buf_sent = 0;
+    ch->InEP_closed = 0;
+    ch->InEP_done = 0;
+    ch->OutEP_ring_head = 0;
+    ch->OutEP_ring_tail = 0;
+    ch->OutEP_ring_pos = 0;
+    ch->session_flags = 0;
+    ch->frame_hdr_idx = 0;
+    ch->frame_left = 0;
+    ch->frame_ready = 0;
+    ch->rti_burst = 0;
+    ch->host_parser.state = PARSE_CMD;
+    ch->parser = &ch->host_parser;
+    memset(ch->macros, 0, sizeof(ch->macros));
+    USBFS_EnableOutEP(ch->out_ep);
+}
+
 /*
  * Main loop
  */
-uint16 read_len;
-uint16 to_be_read;
-uint16 receive_total;
+uint8 slot;
 uint8 cmd, arg;
 uint8 work_cur_state;
-uint16 CLK_JTAG_div;
 uint8 ret;
+uint32 perf_now;
+int sent;
 void loop() {
+    uint8 c;
     for (;;) {
-        uint8 rxData = UART_KitProg_GetChar();
-        switch (rxData) {
-        case 'i':
-            Set_Internal_Power(1);
-            DP("Internal power mode.\n");
-            break;
-        case 'e':
-            Set_Internal_Power(0);
-            DP("External power mode.\n");
-            break;
-        case 'r':
-            DP("Do hard reset.\n");
-            JTAG_Cmd = 0x80;
-            CyDelay(500);
-            JTAG_Cmd = 0x00;
-            break;
-        case 't':
-            DP("Do signal test.\n");
-            CLK_JTAG_SetDividerValue(1 << 7);
-            uint8 cur_msb_lsb = JTAG_Get_Shift_Dir();
-            JTAG_Set_Shift_Dir(MSB_FIRST);
-            uint8 test_bits = 0b11100010;
-            DP("Shift out and Read 8 Bits [%s], last TMS is LOW.\n", toBin(test_bits, 8));
-            ret = JTAG_TAP_Scan(8 - 1, test_bits, 0 /* last TMS is HIGH(1) or LOW(0) */);
-            DP("=>[%s]\n", toBin(ret, 8));
-            DP("Set LSB First.\n");
-            JTAG_Set_Shift_Dir(LSB_FIRST);
-            test_bits = 0b11100010;
-            DP("Shift out and Read 8 Bits [%s], last TMS is HIGH.\n", toBin(test_bits, 8));
-            ret = JTAG_TAP_Scan(8 - 1, test_bits, 1 /* last TMS is HIGH(1) or LOW(0) */);
-            DP("=>[%s]\n", toBin(ret, 8));
-            JTAG_Set_Shift_Dir(cur_msb_lsb);
-            break;
+        if (console_tail != console_head) {
+            console_command(console_queue[console_tail++ & (CONSOLE_QUEUE_SIZE - 1)]);
         }
 
         /* Check if configuration is changed. */
@@ -194,188 +532,996 @@ void loop() {
             /* Re-enable endpoint when device is configured. */
             if (0u != USBFS_GetConfiguration()) {
                 DP("Get USB configration successfully.\n");
-                /* Enable OUT endpoint to receive data from host. */
-                USBFS_EnableOutEP(OUT_EP_NUM);
+                /* Enable OUT endpoints to receive data from host. */
+                for (c = 0; c < CHANNELS; c++) {
+                    USBFS_EnableOutEP(channels[c].out_ep);
+                }
             } else {
                 return;
             }
         }
 
-        /* Check if data from USB host was received. */
-        if (USB_Write_Request_Len != 0) {
-            setStatus(ActIn);
-            OutEP_buf_len = 0;
-            receive_total = 0;
-            to_be_read = USB_Write_Request_Len;
-            while (OutEP_buf_len < to_be_read) {
-                while (USBFS_OUT_BUFFER_FULL != USBFS_GetEPState(OUT_EP_NUM)) {
-                }
-                read_len = USBFS_GetEPCount(OUT_EP_NUM);
-                if (OutEP_buf_len + read_len > BUFFER_SIZE) {
-                    DP3("Received %d/%d bytes\n", receive_total + read_len, to_be_read);
-                    DP3("read_len(%d) exceeds BUFFER_SIZE(%d), drop the excess bytes");
-                    read_len = BUFFER_SIZE - OutEP_buf_len;
-                }
-                USBFS_ReadOutEP(OUT_EP_NUM, OutEP_buf + OutEP_buf_len, read_len);
-                receive_total += read_len;
-                OutEP_buf_len += read_len;
-                USBFS_EnableOutEP(OUT_EP_NUM); /* Enable OUT endpoint to receive next data from host. */
+        for (c = 0; c < CHANNELS; c++) {
+            if (channel_poll(&channels[c]) == -1) {
+                DP("break loop.\n");
+                return;
             }
-            DP2("\r<=Received %d/%d bytes", receive_total, to_be_read);
-            if (OutEP_buf_len > to_be_read) {
-                DP2("Drop %d bytes\n", OutEP_buf_len - to_be_read);
-                OutEP_buf_len = to_be_read;
+        }
+        if (vtref_event) {
+            check_VTref();
+        }
+        trace_drain();
+    }
+}
+
+// Execute commands in received packets while next packets are received by the OUT EP ISR,
+// and send the response. Return -1 if the connection is lost.
+static int channel_poll(CHANNEL *ch) {
+    perf_now = DWT->CYCCNT;
+    perf.cycles += perf_now - perf_last;
+    perf_last = perf_now;
+    USBFS_receive(ch); /* Take a packet held back while the ring was full. */
+    if (ch->rti_burst && !ch->jtag->Clock_Burst_Poll()) {
+        ch->rti_burst = 0;
+        USBFS_push_byte(ch, 0); /* Report completion of CMD 9. */
+    }
+    if (!OUT_RING_EMPTY(ch) && !ch->frame_ready && !ch->rti_burst) {
+        setStatus(ActIn);
+        slot = ch->OutEP_ring_tail & (OUT_RING_SLOTS - 1);
+        if (ch->OutEP_ring_pos == 0) {
+            perf_latency(perf.queue_latency, perf_now - ch->OutEP_ring_time[slot]);
+            if (!ch->perf_resp_valid) {
+                ch->perf_resp_start = ch->OutEP_ring_time[slot];
+                ch->perf_resp_valid = 1;
             }
-            USB_Write_Request_Len -= to_be_read;
-
-            for (int i = 0; i < OutEP_buf_len; i++) {
-                cmd = OutEP_buf[i] & 0x0f;
-                arg = OutEP_buf[i] >> 4;
-                switch (cmd) {
-                case 0: // Set clock divider
-                    DP("CMD 0: Set clock divider [%s] ", toBin(arg, 4));
-                    CLK_JTAG_div = 1 << ((arg >> 1) + 0);
-                    CLK_JTAG_SetDividerValue(CLK_JTAG_div);
-                    DP("=>%.1fkHz\n", 76000.0 / CLK_JTAG_div);
-                    break;
-                case 1: // Set target TAP state
-                    DP2("CMD 1: Set target TAP state [%s] ", toBin(arg, 4));
-                    DP2("=> %s\n", Tap_Desc[arg]);
-                    JTAG_TAP_Move(arg);
-                    break;
-                case 2: // Get target TAP state
-                    DP2("CMD 2: Get target TAP state [%s] ", toBin(arg, 4));
-                    ret = JTAG_TAP_Get_State() | ((tPwr != 0) ? (1 << 5) : 0);
-                    DP2("=>[%s]\n", toBin(ret, 8));
-                    USBFS_push_byte(ret);
-                    break;
-                case 3: // Software reset target TAP
-                    DP("CMD 3: Software reset target TAP\n");
-                    JTAG_TAP_Reset();
-                    break;
-                case 4: // Hardware reset target TAP
-                    DP("CMD 4: Hardware reset target TAP\n");
-                    JTAG_TAP_Reset();
-                    JTAG_Cmd |= 0x80;
-                    CyDelay(1);
-                    JTAG_Cmd &= ~0x80;
-                    JTAG_Reset();
-                    break;
-                case 5: // Set LSB(1)/MSB(0) mode
-                    DP("CMD 5: Set LSB(1)/MSB(0) mode [%s] =>%s\n", toBin(arg, 4), arg ? "LSB" : "MSB");
-                    JTAG_Set_Shift_Dir((arg & 1) ? LSB_FIRST : MSB_FIRST);
-                    break;
-                case 6: // Shift out and Read n Bits
-                    DP2("CMD 6: Shift out and Read n Bits [%s] ", toBin(arg, 4));
-                    if (!(i + 1 < OutEP_buf_len)) {
-                        DP2("=> 2nd byte is not in the OutEP buffer. i=%d read_len=%d\n", i, read_len + 1);
-                        break; // 2nd byte is not in the OutEP buffer.
-                    }
-                    i++;
-                    work_out_bits = OutEP_buf[i];
-                    ret = JTAG_TAP_Scan(arg >> 1, work_out_bits, arg & 1 /* last TMS is HIGH(1) or LOW(0) */);
-                    DP2("%02x ", ret);
-                    if (arg & 1) {
-                        DP2("LAST\n");
-                    }
-                    USBFS_push_byte(ret);
-                    break;
-                case 7: // Run_Test_Idle Loop
-                    DP2("CMD 7: Run_Test_Idle Loop [%s] ", toBin(arg, 4));
-                    work_cur_state = JTAG_TAP_Get_State() & 0x0f;
-                    if (work_cur_state != 1 /* Run_Test_Idle state */) {
-                        DP2("=> current state (%d) != 1%d\n", work_cur_state);
-                        break;
-                    }
-                    while (arg > 0) {
-                        work_RTI_count = (arg > 8) ? 8 : arg;
-                        JTAG_TAP_Scan(work_RTI_count, 0, 0);
-                        arg -= work_RTI_count;
-                    }
-                    DP2("=> done\n");
-                    break;
-                default:
-                    DP2("CMD Unknown: CMD=>%d ARG=%s\n", cmd, toBin(arg, 4));
+        }
+        if (ch->session_flags & SESSION_FRAMED) {
+            ch->OutEP_ring_pos += frame_input(ch, ch->OutEP_ring[slot] + ch->OutEP_ring_pos, ch->OutEP_ring_len[slot] - ch->OutEP_ring_pos);
+        } else {
+            ch->OutEP_ring_pos += parse_commands(ch, ch->OutEP_ring[slot] + ch->OutEP_ring_pos, ch->OutEP_ring_len[slot] - ch->OutEP_ring_pos);
+        }
+        if (ch->OutEP_ring_pos == ch->OutEP_ring_len[slot]) {
+            ch->OutEP_ring_pos = 0;
+            ch->OutEP_ring_tail++;
+        }
+        if (OUT_RING_EMPTY(ch) && ch->USB_Write_Request_Len == 0) {
+            setStatus(ActOut);
+        }
+    } else if (!ch->rti_burst) {
+        perf.out_wait_cycles += DWT->CYCCNT - perf_now;
+    }
+
+    perf_now = DWT->CYCCNT;
+    sent = USBFS_send(ch);
+    perf.send_cycles += DWT->CYCCNT - perf_now;
+    return sent;
+}
+
+// Execute a command received from the KitProg's COM port.
+// They work on the first channel.
+static void console_command(uint8 c) {
+    CHANNEL *ch = &channels[0];
+    switch (c) {
+    case 'i':
+        Set_Internal_Power(1);
+        DP("Internal power mode.\n");
+        break;
+    case 'e':
+        Set_Internal_Power(0);
+        DP("External power mode.\n");
+        break;
+    case 'r':
+        if (console_jtag_busy(ch)) {
+            break;
+        }
+        DP("Do hard reset.\n");
+        ch->jtag->Set_TRST(1);
+        CyDelay(500);
+        ch->jtag->Set_TRST(0);
+        break;
+    case 't':
+        if (console_jtag_busy(ch)) {
+            break;
+        }
+        DP("Do signal test.\n");
+        set_clock_divider(ch, 1 << 7);
+        uint8 cur_msb_lsb = ch->jtag->Get_Shift_Dir();
+        ch->jtag->Set_Shift_Dir(MSB_FIRST);
+        uint8 test_bits = 0b11100010;
+        DP("Shift out and Read 8 Bits [%s], last TMS is LOW.\n", toBin(test_bits, 8));
+        ret = ch->jtag->TAP_Scan(8 - 1, test_bits, 0 /* last TMS is HIGH(1) or LOW(0) */);
+        DP("=>[%s]\n", toBin(ret, 8));
+        DP("Set LSB First.\n");
+        ch->jtag->Set_Shift_Dir(LSB_FIRST);
+        test_bits = 0b11100010;
+        DP("Shift out and Read 8 Bits [%s], last TMS is HIGH.\n", toBin(test_bits, 8));
+        ret = ch->jtag->TAP_Scan(8 - 1, test_bits, 1 /* last TMS is HIGH(1) or LOW(0) */);
+        DP("=>[%s]\n", toBin(ret, 8));
+        ch->jtag->Set_Shift_Dir(cur_msb_lsb);
+        break;
+    case 'b':
+        DP("Do benchmark.\n");
+        run_benchmark(ch);
+        break;
+    }
+}
+
+// Refuse a console command which uses the JTAG component while a CMD 9 burst owns it.
+static uint8 console_jtag_busy(CHANNEL *ch) {
+    if (ch->rti_burst) {
+        DP("Run-Test/Idle burst in progress.\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Number of header bytes following the command byte.
+static uint8 header_len(uint8 cmd, uint8 arg) {
+    switch (cmd) {
+    case 6:
+    case 11:
+        return 1;
+    case 8:
+        return (arg & 2) ? 4 : 2;
+    case 12:
+        return (arg & 2) ? 0 : 4;
+    case 13:
+        return 7;
+    case 14:
+        return 3;
+    case 15:
+        switch (arg) {
+        case 2:
+        case 3:
+            return 2;
+        case 4:
+            return 2 + MACRO_ARGS;
+        case 5:
+            return 1 + MACRO_ARGS;
+        case 6:
+            return 6 + MACRO_ARGS;
+        case 7:
+            return 5;
+        default:
+            return 4;
+        }
+    case 9:
+        return 4;
+    case 10:
+        return (arg & 1) ? 4 : 2;
+    default:
+        return 0;
+    }
+}
+
+// Parse OpenJTAG commands in the given buffer, and return the number of bytes
+// consumed. A command split at the end of the buffer is resumed by the next call.
+// Parsing stops after a command which keeps running in background (RTI burst),
+// or a command not allowed in the macro being run.
+static uint16 parse_commands(CHANNEL *ch, const uint8 *buf, uint16 len) {
+    uint16 i = 0;
+    uint16 n;
+    uint32 bits;
+    uint32 start;
+    while (i < len && !ch->rti_burst && !ch->macro_abort) {
+        start = DWT->CYCCNT;
+        switch (ch->parser->state) {
+        case PARSE_CMD:
+            ch->parser->cmd = buf[i] & 0x0f;
+            ch->parser->arg = buf[i] >> 4;
+            i++;
+            ch->parser->hdr_len = header_len(ch->parser->cmd, ch->parser->arg);
+            ch->parser->hdr_idx = 0;
+            if (ch->parser->hdr_len == 0) {
+                exec_command(ch);
+            } else {
+                ch->parser->state = PARSE_HEADER;
+            }
+            break;
+        case PARSE_HEADER:
+            ch->parser->hdr[ch->parser->hdr_idx++] = buf[i++];
+            if (ch->parser->hdr_idx == ch->parser->hdr_len) {
+                ch->parser->state = PARSE_CMD;
+                exec_command(ch);
+            }
+            break;
+        case PARSE_DATA:
+            if (ch->parser->arg & 8) {
+                i += scan_compare(ch, buf + i, len - i);
+                break;
+            }
+            // Scan as many TDI bytes of a long shift as there are in this buffer.
+            n = MIN(len - i, (ch->parser->bits_left + 7) / 8);
+            bits = MIN(n * 8u, ch->parser->bits_left);
+            ch->parser->bits_left -= bits;
+            if (ch->parser->arg & 4) {
+                ch->jtag->TAP_Scan_Bytes(bits, buf + i, NULL, (ch->parser->arg & 1) && ch->parser->bits_left == 0);
+            } else {
+                ch->jtag->TAP_Scan_Bytes(bits, buf + i, USBFS_reserve(ch, n), (ch->parser->arg & 1) && ch->parser->bits_left == 0);
+                USBFS_commit(ch);
+            }
+            stat_bits += bits;
+            i += n;
+            if (ch->parser->bits_left == 0) {
+                shift_end(ch);
+            }
+            break;
+        case PARSE_TMS:
+            n = MIN(len - i, (ch->parser->bits_left + 7) / 8);
+            bits = MIN(n * 8u, ch->parser->bits_left);
+            ch->parser->bits_left -= bits;
+            ch->jtag->TAP_TMS_Sequence(bits, buf + i);
+            stat_bits += bits;
+            i += n;
+            if (ch->parser->bits_left == 0) {
+                ch->parser->state = PARSE_CMD;
+            }
+            break;
+        case PARSE_MEMAP:
+            i += memap_write(ch, buf + i, len - i);
+            break;
+        case PARSE_MACRO:
+            i += macro_define(ch, buf + i, len - i);
+            break;
+        case PARSE_XSVF:
+            n = xsvf_input(ch, buf + i, MIN(len - i, ch->parser->xsvf_left));
+            i += n;
+            ch->parser->xsvf_left -= n;
+            if (ch->parser->xsvf_left == 0) {
+                ch->parser->state = PARSE_CMD;
+                USBFS_push_byte(ch, ch->xsvf.status);
+                USBFS_push_le(ch, ch->xsvf.inst_count, 4);
+            }
+            break;
+        }
+        if (!ch->macro_running) {
+            perf.cmd_cycles[ch->parser->cmd] += DWT->CYCCNT - start; /* A macro is charged to its CMD 15. */
+        }
+    }
+    return i;
+}
+
+// Scan (TDI, expected TDO, mask) triplets of a compared long shift, and return
+// the number of bytes consumed. A triplet split at the end of the buffer is kept
+// in parser.hdr until the rest arrives.
+static uint16 scan_compare(CHANNEL *ch, const uint8 *buf, uint16 len) {
+    uint16 i = 0;
+    uint16 n;
+    while (i < len && ch->parser->hdr_idx > 0) {
+        ch->parser->hdr[ch->parser->hdr_idx++] = buf[i++];
+        if (ch->parser->hdr_idx == 3) {
+            ch->parser->hdr_idx = 0;
+            compare_bytes(ch, ch->parser->hdr, 1);
+        }
+    }
+    while (ch->parser->state == PARSE_DATA && len - i >= 3) {
+        n = MIN((len - i) / 3, CMP_CHUNK);
+        n = MIN(n, (ch->parser->bits_left + 7) / 8);
+        compare_bytes(ch, buf + i, n);
+        i += n * 3;
+    }
+    while (ch->parser->state == PARSE_DATA && i < len) {
+        ch->parser->hdr[ch->parser->hdr_idx++] = buf[i++];
+    }
+    return i;
+}
+
+// Scan and compare the given number of triplets. The result is pushed at the end of the shift.
+static void compare_bytes(CHANNEL *ch, const uint8 *triplets, uint16 count) {
+    uint8 tdi[CMP_CHUNK];
+    uint8 tdo[CMP_CHUNK];
+    uint8 diff;
+    uint32 bits;
+    uint16 k;
+    uint8 b;
+    uint8 n;
+
+    for (k = 0; k < count; k++) {
+        tdi[k] = triplets[k * 3];
+    }
+    bits = MIN(count * 8u, ch->parser->bits_left);
+    ch->parser->bits_left -= bits;
+    ch->jtag->TAP_Scan_Bytes(bits, tdi, tdo, (ch->parser->arg & 1) && ch->parser->bits_left == 0);
+    stat_bits += bits;
+    for (k = 0; k < count && ch->parser->mismatch == CMP_PASS; k++) {
+        // The n bits of a partial last byte are returned in bit n-1 to bit0, as TAP_Scan() does.
+        n = MIN(8u, bits - k * 8u);
+        diff = (tdo[k] ^ triplets[k * 3 + 1]) & triplets[k * 3 + 2] & (0xff >> (8 - n));
+        if (diff != 0) {
+            // Find the first shifted bit which differs. (bit0 in LSB first, bit n-1 in MSB first)
+            for (b = 0; b < n; b++) {
+                if (diff & ((ch->jtag->Get_Shift_Dir() == LSB_FIRST) ? (1 << b) : (1 << (n - 1 - b)))) {
                     break;
                 }
             }
+            ch->parser->mismatch = ch->parser->bit_pos + k * 8u + b;
+        }
+    }
+    ch->parser->bit_pos += bits;
 
-            setStatus(ActOut);
+    if (ch->parser->bits_left == 0) {
+        shift_end(ch);
+        if (ch->parser->mismatch == CMP_PASS) {
+            USBFS_push_byte(ch, 0);
+        } else {
+            USBFS_push_byte(ch, 1);
+            USBFS_push_le(ch, ch->parser->mismatch, 4);
         }
+    }
+}
+
+// Start a long shift of CMD 8 or CMD 14. parser.arg holds the CMD 8 flags.
+static void shift_start(CHANNEL *ch, uint32 bits) {
+    ch->parser->bits_left = bits;
+    ch->parser->bit_pos = 0;
+    ch->parser->mismatch = CMP_PASS;
+    ch->parser->hdr_idx = 0; /* Bytes of a split (TDI, TDO, mask) triplet kept in hdr. */
+    if (bits > 0) {
+        ch->parser->state = PARSE_DATA;
+        return;
+    }
+    shift_end(ch);
+    if (ch->parser->arg & 8) {
+        USBFS_push_byte(ch, 0);
+    }
+}
 
-        if (USBFS_send() == -1) {
-            DP("break loop.\n");
-            return;
+// Finish a long shift, and move to the end state of CMD 14.
+static void shift_end(CHANNEL *ch) {
+    ch->parser->state = PARSE_CMD;
+    if (ch->parser->end_state != TAP_STATE_NONE) {
+        ch->jtag->TAP_Move(ch->parser->end_state);
+    }
+}
+
+// Execute the parsed command.
+static void exec_command(CHANNEL *ch) {
+    cmd = ch->parser->cmd;
+    arg = ch->parser->arg;
+    stat_cmds++;
+    perf.cmd_count[cmd] += !ch->macro_running;
+    if (ch->macro_running && (cmd == 9 || (cmd == 15 && arg != 2 && arg != 3))) {
+        DP2("CMD %d: not allowed in a macro\n", cmd);
+        ch->macro_abort = 1;
+        return;
+    }
+    if (cmd != 12 && cmd != 13) {
+        ch->dap_ir = DAP_IR_UNKNOWN; /* The command may leave another instruction in IR. */
+    }
+    switch (cmd) {
+    case 0: // Set clock divider
+        set_clock_divider(ch, 1 << ((arg >> 1) + 0));
+        break;
+    case 1: // Set target TAP state
+        DP2("CMD 1: Set target TAP state [%s] ", toBin(arg, 4));
+        DP2("=> %s\n", Tap_Desc[arg]);
+        ch->jtag->TAP_Move(arg);
+        break;
+    case 2: // Get target TAP state
+        DP2("CMD 2: Get target TAP state [%s] ", toBin(arg, 4));
+        ret = ch->jtag->TAP_Get_State() | ((tPwr != 0) ? (1 << 5) : 0);
+        DP2("=>[%s]\n", toBin(ret, 8));
+        USBFS_push_byte(ch, ret);
+        break;
+    case 3: // Software reset target TAP
+        TRACE(TR_TAP_RESET, 0, 0, 0);
+        ch->jtag->TAP_Reset();
+        break;
+    case 4: // Hardware reset target TAP
+        TRACE(TR_HW_RESET, 0, 0, 0);
+        ch->jtag->TAP_Reset();
+        ch->jtag->Set_TRST(1);
+        CyDelay(1);
+        ch->jtag->Set_TRST(0);
+        ch->jtag->Reset();
+        break;
+    case 5: // Set LSB(1)/MSB(0) mode
+        TRACE(TR_SHIFT_DIR, arg & 1, 0, 0);
+        ch->jtag->Set_Shift_Dir((arg & 1) ? LSB_FIRST : MSB_FIRST);
+        break;
+    case 6: // Shift out and Read n Bits
+        DP2("CMD 6: Shift out and Read n Bits [%s] ", toBin(arg, 4));
+        work_out_bits = ch->parser->hdr[0];
+        ret = ch->jtag->TAP_Scan(arg >> 1, work_out_bits, arg & 1 /* last TMS is HIGH(1) or LOW(0) */);
+        stat_bits += (arg >> 1) + 1;
+        DP2("%02x ", ret);
+        if (arg & 1) {
+            DP2("LAST\n");
+        }
+        USBFS_push_byte(ch, ret);
+        break;
+    case 7: // Run_Test_Idle Loop
+        DP2("CMD 7: Run_Test_Idle Loop [%s] ", toBin(arg, 4));
+        work_cur_state = ch->jtag->TAP_Get_State() & 0x0f;
+        if (work_cur_state != 1 /* Run_Test_Idle state */) {
+            DP2("=> current state (%d) != 1%d\n", work_cur_state);
+            break;
+        }
+        stat_bits += arg;
+        while (arg > 0) {
+            work_RTI_count = (arg > 8) ? 8 : arg;
+            ch->jtag->TAP_Scan(work_RTI_count, 0, 0);
+            arg -= work_RTI_count;
         }
-        check_VTref();
+        DP2("=> done\n");
+        break;
+    case 8: // Long shift out and read n bits
+        // arg: bit0 = last TMS, bit1 = 32-bit(1)/16-bit(0) bit count, bit2 = no TDO capture,
+        // bit3 = compare. Followed by the little-endian bit count and packed TDI bytes, which
+        // are scanned by parse_commands() as they arrive.
+        // With compare, each TDI byte is followed by its expected TDO and mask bytes, and
+        // only the result is returned: 0 if all masked bits match, or 1 followed by the
+        // offset of the first mismatching bit (32 bits).
+        DP2("CMD 8: Long shift out and read n bits [%s] ", toBin(arg, 4));
+        ch->parser->end_state = TAP_STATE_NONE;
+        shift_start(ch, get_le(ch->parser->hdr, ch->parser->hdr_len));
+        DP2("=> %lu bits\n", ch->parser->bits_left);
+        break;
+    case 9: // Run_Test_Idle burst
+        // Followed by the little-endian 32-bit clock count. The clocks are generated
+        // while the main loop keeps USB running, and the completion status (0) is
+        // returned. 1 is returned if the TAP is not in Run_Test_Idle.
+        DP2("CMD 9: Run_Test_Idle burst [%s] ", toBin(arg, 4));
+        work_cur_state = ch->jtag->TAP_Get_State() & 0x0f;
+        if (work_cur_state != 1 /* Run_Test_Idle state */) {
+            DP2("=> current state (%d) != 1\n", work_cur_state);
+            USBFS_push_byte(ch, 1);
+            break;
+        }
+        work_RTI_clocks = get_le(ch->parser->hdr, 4);
+        DP2("=> %lu clocks\n", work_RTI_clocks);
+        stat_bits += work_RTI_clocks;
+        ch->jtag->Clock_Burst_Start(work_RTI_clocks);
+        ch->rti_burst = 1;
+        break;
+    case 10: // Set clock divider or frequency
+        // arg: bit0 = 32-bit frequency in kHz(1) / 16-bit divider(0), followed by
+        // the little-endian value. Returns the applied TCK frequency in Hz (32 bits).
+        DP2("CMD 10: Set clock [%s] ", toBin(arg, 4));
+        if (arg & 1) {
+            set_clock_divider(ch, khz_to_divider(get_le(ch->parser->hdr, 4)));
+        } else {
+            set_clock_divider(ch, MAX(get_le(ch->parser->hdr, 2), 1));
+        }
+        work_clock_hz = CLK_JTAG_KHZ * 1000u / ch->clk_div;
+        DP2("=> div %u, %lu Hz\n", ch->clk_div, work_clock_hz);
+        USBFS_push_le(ch, work_clock_hz, 4);
+        break;
+    case 11: // Shift out n Bits without capture
+        // Same as CMD 6, but TDO is not returned.
+        DP2("CMD 11: Shift out n Bits [%s] ", toBin(arg, 4));
+        ch->jtag->TAP_Scan(arg >> 1, ch->parser->hdr[0], arg & 1);
+        stat_bits += (arg >> 1) + 1;
+        DP2("%s\n", (arg & 1) ? "LAST" : "");
+        break;
+    case 12: // DAP transaction
+        // arg: bit0 = APACC(1)/DPACC(0), bit1 = read(1)/write(0), bit2-3 = A[3:2].
+        // Followed by the little-endian 32-bit data for a write. The DAP must be the
+        // only TAP in the chain. Returns the ACK and the data read (32 bits).
+        DP2("CMD 12: DAP transaction [%s] ", toBin(arg, 4));
+        work_dap_data = (arg & 2) ? 0 : get_le(ch->parser->hdr, 4);
+        ret = dap_transfer(ch, arg & 1, (arg >> 1) & 1, (arg >> 2) << 2, &work_dap_data);
+        DP2("=> ACK %d, %08lx\n", ret, work_dap_data);
+        USBFS_push_byte(ch, ret);
+        USBFS_push_le(ch, work_dap_data, 4);
+        break;
+    case 13: // MEM-AP block transfer
+        // arg: bit0 = read(1)/write(0). Followed by the AP number, the little-endian
+        // 32-bit address and 16-bit word count, and the data words for a write.
+        // A read returns the words, and both return the ACK and the number of words
+        // done (16 bits). Words after an error are returned as 0.
+        DP2("CMD 13: MEM-AP block transfer [%s] ", toBin(arg, 4));
+        memap_start(ch, ch->parser->hdr[0], get_le(ch->parser->hdr + 1, 4), get_le(ch->parser->hdr + 5, 2));
+        DP2("=> AP %d, %08lx, %u words\n", ch->parser->hdr[0], ch->memap.addr, ch->memap.left);
+        if (arg & 1) {
+            memap_read(ch);
+            memap_finish(ch, 0);
+        } else if (ch->memap.left > 0) {
+            ch->parser->state = PARSE_MEMAP;
+        } else {
+            memap_finish(ch, 1);
+        }
+        break;
+    case 14: // Move, shift and move
+        // arg: bit0 = IR(1)/DR(0), bit1 = no TDO capture, bit2 = compare. Followed by the
+        // end state (low nibble), the little-endian 16-bit bit count, and the TDI bytes
+        // (and expected TDO and mask bytes with compare) as CMD 8.
+        // Moves to Shift-IR/DR, shifts with the last TMS high, then moves to the end state.
+        DP2("CMD 14: Move, shift and move [%s] ", toBin(arg, 4));
+        ch->jtag->TAP_Move((arg & 1) ? 11 /* Shift-IR */ : 4 /* Shift-DR */);
+        ch->parser->end_state = ch->parser->hdr[0] & 0x0f;
+        ch->parser->arg = 1 | ((arg & 2) ? 4 : 0) | ((arg & 4) ? 8 : 0); /* CMD 8 flags */
+        shift_start(ch, get_le(ch->parser->hdr + 1, 2));
+        DP2("=> %lu bits, %s\n", ch->parser->bits_left, Tap_Desc[ch->parser->end_state]);
+        break;
+    case 15: // Play XSVF, set DAP WAIT limit, TMS sequence, macros, or TCK calibration
+        if (arg == 2) {
+            // Followed by the little-endian 16-bit WAIT retry limit of CMD 12.
+            ch->dap_wait_limit = get_le(ch->parser->hdr, 2);
+            DP2("CMD 15: DAP WAIT limit => %u\n", ch->dap_wait_limit);
+            break;
+        }
+        if (arg == 3) {
+            // Followed by the little-endian 16-bit bit count and the packed TMS bits,
+            // LSB of each byte first. TDI is held low, and the TAP state follows TMS.
+            ch->parser->bits_left = get_le(ch->parser->hdr, 2);
+            DP2("CMD 15: TMS sequence => %lu bits\n", ch->parser->bits_left);
+            if (ch->parser->bits_left > 0) {
+                ch->parser->state = PARSE_TMS;
+            }
+            break;
+        }
+        if (arg == 4) {
+            // Define a macro. Followed by the ID, the body length (8 bits), the body offset
+            // of each argument byte (0xff = not used), and the body of complete commands.
+            // Returns the status (MACRO_STATUS) after the body.
+            ch->parser->macro_id = ch->parser->hdr[0];
+            ch->parser->macro_left = ch->parser->hdr[1];
+            DP2("CMD 15: Define macro %u => %u bytes\n", ch->parser->macro_id, ch->parser->macro_left);
+            if (ch->parser->macro_id < MACRO_SLOTS) {
+                ch->macros[ch->parser->macro_id].len = 0; /* Not runnable until the body is complete. */
+                memcpy(ch->macros[ch->parser->macro_id].param, ch->parser->hdr + 2, MACRO_ARGS);
+            }
+            ch->parser->state = PARSE_MACRO;
+            macro_define(ch, NULL, 0); /* Finish an empty body. */
+            break;
+        }
+        if (arg == 5) {
+            // Run a macro. Followed by the ID and the argument bytes.
+            // Returns the output of the macro, then the status (MACRO_STATUS).
+            DP2("CMD 15: Run macro %u\n", ch->parser->hdr[0]);
+            USBFS_push_byte(ch, macro_run(ch, ch->parser->hdr[0], ch->parser->hdr + 1));
+            break;
+        }
+        if (arg == 6) {
+            // Run a macro until a TDO bit of its output matches. Followed by the ID, the
+            // argument bytes, the bit offset (16 bits), the expected value (bit0) and the
+            // maximum number of runs (16 bits).
+            macro_poll(ch, ch->parser->hdr);
+            break;
+        }
+        if (arg == 7) {
+            // Find the fastest TCK. Followed by the fastest and the slowest dividers
+            // (16 bits each) and the number of clean iterations needed at a divider.
+            // Returns the status (CAL_STATUS), the divider set (16 bits, 0 if none passed),
+            // the number of dividers tried, and the divider (16 bits) and the failed
+            // iterations (8 bits) of each. The TAP is left in Test-Logic-Reset.
+            DP2("CMD 15: TCK calibration\n");
+            tck_calibrate(ch, get_le(ch->parser->hdr, 2), get_le(ch->parser->hdr + 2, 2), ch->parser->hdr[4]);
+            break;
+        }
+        // arg: 0 = start, 1 = continue. Followed by the little-endian byte count of
+        // the XSVF chunk and the chunk, which is played by parse_commands() as it
+        // arrives. Returns the player status (XSVF_STATUS) and the number of XSVF
+        // instructions done (32 bits) after the chunk.
+        DP2("CMD 15: Play XSVF [%s] ", toBin(arg, 4));
+        if (arg == 0) {
+            xsvf_start(ch);
+        }
+        ch->parser->xsvf_left = get_le(ch->parser->hdr, 4);
+        DP2("=> %lu bytes\n", ch->parser->xsvf_left);
+        ch->parser->state = PARSE_XSVF;
+        if (ch->parser->xsvf_left == 0) {
+            ch->parser->state = PARSE_CMD;
+            USBFS_push_byte(ch, ch->xsvf.status);
+            USBFS_push_le(ch, ch->xsvf.inst_count, 4);
+        }
+        break;
+    default:
+        DP2("CMD Unknown: CMD=>%d ARG=%s\n", cmd, toBin(arg, 4));
+        break;
+    }
+}
+
+// Get little-endian value of len bytes.
+static uint32 get_le(const uint8 *buf, uint8 len) {
+    uint32 val = 0;
+    while (len > 0) {
+        len--;
+        val = (val << 8) | buf[len];
+    }
+    return val;
+}
+
+// Set TCK clock divider.
+static void set_clock_divider(CHANNEL *ch, uint16 div) {
+    ch->clk_div = div;
+    ch->jtag->Clock_SetDividerValue(ch->clk_div);
+    TRACE(TR_SET_CLOCK, ch->clk_div & 0xff, ch->clk_div >> 8, 0);
+}
+
+// Return the divider whose TCK frequency is the closest to the given one.
+static uint16 khz_to_divider(uint32 khz) {
+    uint32 div;
+    if (khz == 0) {
+        return 0xffff;
+    }
+    div = CLK_JTAG_KHZ / khz;
+    if (div == 0) {
+        return 1;
     }
+    if (div >= 0xffff) {
+        return 0xffff;
+    }
+    // Choose div or div + 1. (khz is between CLK_JTAG_KHZ/(div+1) and CLK_JTAG_KHZ/div)
+    if ((float)CLK_JTAG_KHZ / div - khz > khz - (float)CLK_JTAG_KHZ / (div + 1)) {
+        div++;
+    }
+    return div;
+}
+
+// Convert the VTref thresholds to ADC counts once, so Slow_Tick_ISR compares integers.
+// ADC counts are linear in volts.
+static void vtref_init(void) {
+    float counts_per_volt = 1024 / (ADC_CountsTo_Volts(1024) - ADC_CountsTo_Volts(0));
+    vtref_on_counts = (int32)((VTREF_THRESHOLD + VTREF_HYSTERESIS - ADC_CountsTo_Volts(0)) * counts_per_volt);
+    vtref_off_counts = (int32)((VTREF_THRESHOLD - VTREF_HYSTERESIS - ADC_CountsTo_Volts(0)) * counts_per_volt);
 }
 
-// Check VTref voltage.
-float VTref_val = 0.0f;
-uint8 new_tPwr;
+// Apply target power detected by Slow_Tick_ISR.
 static void check_VTref() {
-    if (last_count != count) {
-        last_count = count;
-        VTref_val = ADC_CountsTo_Volts(ADC_GetResult32());
-        DP("VTref=%6.2f\r", VTref_val);
-        new_tPwr = (VTref_val > VTREF_THRESHOLD);
-        if (tPwr != new_tPwr) {
-            tPwr = new_tPwr;
-            CLK_PWM_SetDivider(!tPwr ? 0xffff : PWM_clock_divider);
-            DP("\nTarget power is changed to %s.\n", tPwr ? "On" : "Off");
+    uint16 mv;
+    vtref_event = 0;
+    mv = (uint16)ADC_CountsTo_mVolts(vtref_counts);
+    TRACE(TR_VTREF, mv & 0xff, mv >> 8, 0);
+    if (tPwr != vtref_pwr) {
+        tPwr = vtref_pwr;
+        CLK_PWM_SetDivider(!tPwr ? 0xffff : PWM_clock_divider);
+        TRACE(TR_TARGET_POWER, tPwr, 0, 0);
+    }
+}
+
+// Put a trace record. Drop it and count if the buffer is full.
+static void trace_put(uint8 id, uint8 a0, uint8 a1, uint8 a2) {
+    uint8 *rec;
+    uint16 timer;
+    if ((uint8)(trace_head - trace_tail) == TRACE_RECS) {
+        trace_lost++;
+        return;
+    }
+    timer = Timer_1_ReadCounter();
+    rec = trace_buf[trace_head & (TRACE_RECS - 1)];
+    rec[0] = TRACE_SYNC;
+    rec[1] = id;
+    rec[2] = a0;
+    rec[3] = a1;
+    rec[4] = a2;
+    rec[5] = timer & 0xff;
+    rec[6] = timer >> 8;
+    rec[7] = count & 0xff;
+    trace_head++;
+}
+
+// Send trace records to UART as far as TX FIFO is not full.
+static void trace_drain(void) {
+    if (trace_lost != 0 && (uint8)(trace_head - trace_tail) < TRACE_RECS) {
+        uint16 lost = trace_lost;
+        trace_lost = 0;
+        trace_put(TR_LOST, lost & 0xff, lost >> 8, 0);
+    }
+    while (trace_head != trace_tail && (UART_KitProg_ReadTxStatus() & UART_KitProg_TX_STS_FIFO_NOT_FULL)) {
+        UART_KitProg_WriteTxData(trace_buf[trace_tail & (TRACE_RECS - 1)][trace_pos]);
+        if (++trace_pos == TRACE_REC_SIZE) {
+            trace_pos = 0;
+            trace_tail++;
         }
     }
 }
 
-// Push 1 byte to InEP buffer.
-static void USBFS_push_byte(uint8 b) {
-    if (InEP_buf_idx >= BUFFER_SIZE) {
+// Send the rest of a partially sent trace record, so that text does not split it.
+static void trace_finish(void) {
+    if (trace_pos == 0) {
         return;
     }
-    InEP_buf[InEP_buf_idx++] = b;
+    while (trace_pos < TRACE_REC_SIZE) {
+        UART_KitProg_PutChar(trace_buf[trace_tail & (TRACE_RECS - 1)][trace_pos++]);
+    }
+    trace_pos = 0;
+    trace_tail++;
 }
 
-// Send InEP buffer.
-int16 to_be_sent = 0;
-int16 total_sent = 0;
-uint16 timeout = 1000;
-static int USBFS_send() {
-    if (USB_Read_Request_Len == 0) {
-        return 0;
+// Copy a received OUT packet into OutEP_ring, and re-enable OUT EP to receive the next one.
+// Called from OUT EP ISR, and from loop() when a slot is freed.
+static void USBFS_receive(CHANNEL *ch) {
+    uint8 intr_state = CyEnterCriticalSection();
+    uint8 framed = ch->session_flags & SESSION_FRAMED;
+    if ((framed || ch->USB_Write_Request_Len != 0) && !OUT_RING_FULL(ch) && USBFS_OUT_BUFFER_FULL == USBFS_GetEPState(ch->out_ep)) {
+        uint8 slot = ch->OutEP_ring_head & (OUT_RING_SLOTS - 1);
+        uint16 len = USBFS_GetEPCount(ch->out_ep);
+        if (!framed && len > ch->USB_Write_Request_Len) {
+            len = ch->USB_Write_Request_Len; /* Drop the excess bytes. */
+        }
+        USBFS_ReadOutEP(ch->out_ep, ch->OutEP_ring[slot], len);
+        USBFS_EnableOutEP(ch->out_ep);
+        ch->OutEP_ring_len[slot] = len;
+        ch->OutEP_ring_time[slot] = DWT->CYCCNT;
+        ch->OutEP_ring_head++;
+        perf.out_bytes += len;
+        if (!framed) {
+            ch->USB_Write_Request_Len -= len;
+        }
+    }
+    CyExitCriticalSection(intr_state);
+}
+
+// Strip frame headers, and parse the commands in the frame payload.
+// Return the number of bytes consumed, which stops at the end of a frame.
+static uint16 frame_input(CHANNEL *ch, const uint8 *buf, uint16 len) {
+    uint16 i = 0;
+    uint16 n;
+    while (i < len) {
+        if (ch->frame_hdr_idx < FRAME_HDR_SIZE) {
+            if (ch->frame_hdr_idx == 0 && ch->InEP_buf_idx + FRAME_HDR_SIZE > BUFFER_SIZE) {
+                return i; /* Wait for the previous response to make room for the response header. */
+            }
+            ch->frame_hdr[ch->frame_hdr_idx++] = buf[i++];
+            if (ch->frame_hdr_idx < FRAME_HDR_SIZE) {
+                continue;
+            }
+            ch->frame_left = get_le(ch->frame_hdr, 2);
+            frame_open(ch);
+        }
+        n = parse_commands(ch, buf + i, MIN(len - i, ch->frame_left));
+        i += n;
+        ch->frame_left -= n;
+        if (ch->frame_left == 0) {
+            ch->frame_hdr_idx = 0;
+            ch->frame_ready = 1;
+            return i;
+        }
+        if (ch->rti_burst) {
+            return i;
+        }
     }
-    DP3("InEP_buf_idx=%d USB_Read_Request_Len=%d\n", InEP_buf_idx, USB_Read_Request_Len);
-    DP3("\n=>Send %d bytes\n", InEP_buf_idx);
-    for (int i = 0; i < InEP_buf_idx; i++) {
-        DP3(" %02x", InEP_buf[i]);
-        if ((i % 16) == 15) {
-            DP3("\n");
+    return i;
+}
+
+// Start a response (or the next chunk of it) with room for its header.
+static void frame_open(CHANNEL *ch) {
+    ch->frame_resp_pos = ch->InEP_buf_idx;
+    ch->InEP_buf_idx += FRAME_HDR_SIZE; /* Filled by frame_close(). */
+    ch->frame_overflow_base = ch->usb_in_overflow;
+}
+
+// Fill the response header of the executed frame, and close the response.
+// status is FRAME_STAT_MORE when a chunk of the response is closed before the end of the frame.
+static void frame_close(CHANNEL *ch, uint8 status) {
+    uint16 len = ch->InEP_buf_idx - ch->frame_resp_pos - FRAME_HDR_SIZE;
+    uint16 n;
+    status |= (ch->usb_in_overflow != ch->frame_overflow_base) ? FRAME_STAT_OVERFLOW : 0;
+    if (ch->session_flags & SESSION_RLE) {
+        n = rle_encode(ch->InEP_buf + ch->frame_resp_pos + FRAME_HDR_SIZE, len, rle_buf, len - 1);
+        if (n != 0) {
+            memcpy(ch->InEP_buf + ch->frame_resp_pos + FRAME_HDR_SIZE, rle_buf, n);
+            ch->InEP_buf_idx -= len - n;
+            len = n;
+            status |= FRAME_STAT_RLE;
         }
     }
-    DP3("\n");
+    ch->InEP_buf[ch->frame_resp_pos + 0] = len & 0xff;
+    ch->InEP_buf[ch->frame_resp_pos + 1] = len >> 8;
+    ch->InEP_buf[ch->frame_resp_pos + 2] = ch->frame_hdr[2];
+    ch->InEP_buf[ch->frame_resp_pos + 3] = status;
+    ch->InEP_end = ch->InEP_buf_idx;
+    ch->InEP_closed = 1;
+    ch->frame_ready = 0;
+}
 
-    to_be_sent = 0;
-    total_sent = 0;
-    timeout = 1000;
-    do {
-        to_be_sent = MIN(InEP_buf_idx - total_sent, EP_SIZE);
-        DP3("Try to send %d\n", to_be_sent);
-        while (USBFS_IN_BUFFER_EMPTY != USBFS_GetEPState(IN_EP_NUM)) {
-            CyDelay(1);
-            if (--timeout == 0) {
-                DP("USBFS_send() timeout.\n");
+// The response of the frame being executed fills InEP buffer. Send it so far as a chunk,
+// and continue it in the next one. Return 0 if len bytes do not fit in a chunk.
+static uint8 frame_continue(CHANNEL *ch, uint16 len) {
+    if (len > BUFFER_SIZE - FRAME_HDR_SIZE || ch->frame_hdr_idx < FRAME_HDR_SIZE || !USBFS_flush(ch)) {
+        return 0;
+    }
+    frame_close(ch, FRAME_STAT_MORE);
+    if (!USBFS_flush(ch)) {
+        return 0;
+    }
+    frame_open(ch);
+    return 1;
+}
+
+// Run-length encode len bytes. Return the encoded length, or 0 if it exceeds max.
+static uint16 rle_encode(const uint8 *in, uint16 len, uint8 *out, uint16 max) {
+    uint16 i = 0;
+    uint16 o = 0;
+    uint16 lit = 0; // start of pending literal bytes
+    uint16 run;
+    uint16 n;
+    while (i <= len) {
+        run = 1;
+        while (i + run < len && in[i + run] == in[i] && run < RLE_MAX_RUN) {
+            run++;
+        }
+        if (i == len || run >= RLE_MIN_RUN) {
+            // Flush the literal bytes before the run (or at the end).
+            while (lit < i) {
+                n = MIN(i - lit, RLE_MAX_LITERAL);
+                if (o + 1 + n > max) {
+                    return 0;
+                }
+                out[o++] = n - 1;
+                memcpy(out + o, in + lit, n);
+                o += n;
+                lit += n;
+            }
+            if (i == len) {
+                break;
+            }
+            if (o + 2 > max) {
                 return 0;
             }
+            out[o++] = 0x80 | (run - RLE_MIN_RUN);
+            out[o++] = in[i];
+            i += run;
+            lit = i;
+        } else {
+            i += run;
+        }
+    }
+    return o;
+}
+
+// Push 1 byte to InEP buffer.
+static void USBFS_push_byte(CHANNEL *ch, uint8 b) {
+    stat_in_bytes++;
+    if (!USBFS_make_room(ch, 1)) {
+        USBFS_overflow(ch, 1);
+        return;
+    }
+    ch->InEP_buf[ch->InEP_buf_idx++] = b;
+}
+
+// Push a little-endian value of len bytes to InEP buffer.
+static void USBFS_push_le(CHANNEL *ch, uint32 val, uint8 len) {
+    while (len > 0) {
+        USBFS_push_byte(ch, val & 0xff);
+        val >>= 8;
+        len--;
+    }
+}
+
+// Reserve len bytes in InEP buffer. Return NULL if they do not fit.
+// The bytes are not sent until USBFS_commit() is called after they are written.
+static uint8 *USBFS_reserve(CHANNEL *ch, uint16 len) {
+    stat_in_bytes += len;
+    if (!USBFS_make_room(ch, len)) {
+        USBFS_overflow(ch, len);
+        ch->InEP_reserved = 0;
+        return NULL;
+    }
+    ch->InEP_reserved = len;
+    return ch->InEP_buf + ch->InEP_buf_idx;
+}
+
+// Commit the bytes reserved by USBFS_reserve().
+static void USBFS_commit(CHANNEL *ch) {
+    ch->InEP_buf_idx += ch->InEP_reserved;
+    ch->InEP_reserved = 0;
+}
+
+// Make room for len bytes in InEP buffer. Wait for the host to read the open response,
+// and reclaim the bytes sent by IN EP ISR. OpenOCD sends JTAG_READ after the bulk OUT,
+// so the read request may come only now. It never comes if the rest of the OUT data
+// does not fit in OutEP_ring and OUT EP, and then the bytes are dropped. In the self-framed
+// protocol, the response is sent in chunks. Return 0 if they do not fit.
+static uint8 USBFS_make_room(CHANNEL *ch, uint16 len) {
+    uint8 intr_state;
+    while (ch->InEP_buf_idx + len > BUFFER_SIZE) {
+        if (ch->session_flags & SESSION_FRAMED) {
+            return frame_continue(ch, len);
+        }
+        if (len > BUFFER_SIZE || ch->InEP_closed || 0u == USBFS_GetConfiguration()) {
+            return 0;
+        }
+        if (ch->USB_Read_Request_Len == 0 && ch->USB_Write_Request_Len > EP_SIZE && OUT_RING_FULL(ch)) {
+            return 0;
+        }
+        USBFS_load_next(ch); /* Nothing is sent until JTAG_READ arrives. */
+        intr_state = CyEnterCriticalSection();
+        if (ch->InEP_buf_sent > 0) {
+            ch->InEP_buf_idx -= ch->InEP_buf_sent;
+            memmove(ch->InEP_buf, ch->InEP_buf + ch->InEP_buf_sent, ch->InEP_buf_idx);
+            ch->InEP_buf_sent = 0;
+        }
+        CyExitCriticalSection(intr_state);
+    }
+    return 1;
+}
+
+// Wait for IN EP ISR to send the closed response, and reclaim it.
+// Return 0 if the device is unconfigured before that.
+static uint8 USBFS_flush(CHANNEL *ch) {
+    while (ch->InEP_closed) {
+        if (0u == USBFS_GetConfiguration()) {
+            return 0;
+        }
+        USBFS_load_next(ch);
+        if (ch->InEP_done) {
+            USBFS_reclaim(ch);
+        }
+    }
+    return 1;
+}
+
+// Count TDO bytes lost because the host did not read InEP buffer in time.
+static void USBFS_overflow(CHANNEL *ch, uint16 len) {
+    if (ch->usb_in_overflow == 0) {
+        TRACE(TR_IN_OVERFLOW, ch->InEP_buf_idx & 0xff, ch->InEP_buf_idx >> 8, 0);
+    }
+    ch->usb_in_overflow += len;
+}
+
+// Load next IN packet if IN EP is free. Called from IN EP ISR, and from USBFS_send().
+// Until the response is closed, only full packets are loaded. The last packet of
+// a response is short, or zero-length if the response is a multiple of EP_SIZE.
+static void USBFS_load_next(CHANNEL *ch) {
+    uint8 intr_state = CyEnterCriticalSection();
+    uint16 len;
+    if ((ch->USB_Read_Request_Len != 0 || (ch->session_flags & SESSION_FRAMED)) && !ch->InEP_done &&
+        USBFS_IN_BUFFER_EMPTY == USBFS_GetEPState(ch->in_ep)) {
+        // In the self-framed protocol, the response header is filled when it is closed.
+        len = ch->InEP_closed ? ch->InEP_end - ch->InEP_buf_sent : (ch->session_flags & SESSION_FRAMED) ? 0 : ch->InEP_buf_idx - ch->InEP_buf_sent;
+        if (len >= EP_SIZE) {
+            USBFS_LoadInEP(ch->in_ep, ch->InEP_buf + ch->InEP_buf_sent, EP_SIZE);
+            ch->InEP_buf_sent += EP_SIZE;
+        } else if (ch->InEP_closed) {
+            USBFS_LoadInEP(ch->in_ep, ch->InEP_buf + ch->InEP_buf_sent, len);
+            ch->InEP_buf_sent += len;
+            ch->InEP_done = 1;
+            ch->InEP_done_time = DWT->CYCCNT;
+        }
+    }
+    CyExitCriticalSection(intr_state);
+}
+
+// Send InEP buffer.
+// The response is closed when all requested OUT data (or a frame in the self-framed
+// protocol) is executed, and the rest of it is sent from IN EP ISR. Results of the
+// following commands are kept for the next one.
+static int USBFS_send(CHANNEL *ch) {
+    if (ch->session_flags & SESSION_FRAMED) {
+        if (!ch->InEP_closed && ch->frame_ready && !ch->rti_burst) {
+            frame_close(ch, 0);
         }
-        USBFS_LoadInEP(IN_EP_NUM, InEP_buf + total_sent, to_be_sent);
-        total_sent += to_be_sent;
-        DP3("Sent %d (%d/%d)\n", to_be_sent, total_sent, InEP_buf_idx);
-    } while (to_be_sent == EP_SIZE);
-    InEP_buf_idx = 0;
-    USB_Read_Request_Len = 0;
+    } else if (ch->USB_Read_Request_Len == 0) {
+        return 0;
+    } else if (!ch->InEP_closed && ch->USB_Write_Request_Len == 0 && OUT_RING_EMPTY(ch) && !ch->rti_burst) {
+        DP3("ch->InEP_buf_idx=%d ch->USB_Read_Request_Len=%lu\n", ch->InEP_buf_idx, ch->USB_Read_Request_Len);
+        ch->InEP_end = ch->InEP_buf_idx;
+        ch->InEP_closed = 1;
+    }
+    if (ch->InEP_closed && ch->perf_resp_valid) {
+        ch->perf_closed_start = ch->perf_resp_start; /* Following packets are for the next response. */
+        ch->perf_closed_valid = 1;
+        ch->perf_resp_valid = 0;
+    }
+    USBFS_load_next(ch);
+    if (ch->InEP_done) {
+        USBFS_reclaim(ch);
+    }
     return 0;
 }
 
+// Drop the response sent, and keep the results which follow it for the next one.
+static void USBFS_reclaim(CHANNEL *ch) {
+    uint8 intr_state;
+    DP3("Sent %d bytes\n", ch->InEP_end);
+    intr_state = CyEnterCriticalSection();
+    ch->InEP_buf_idx -= ch->InEP_end;
+    memmove(ch->InEP_buf, ch->InEP_buf + ch->InEP_end, ch->InEP_buf_idx);
+    ch->InEP_buf_sent = 0;
+    ch->InEP_closed = 0;
+    ch->InEP_done = 0;
+    ch->USB_Read_Request_Len = 0;
+    CyExitCriticalSection(intr_state);
+    ch->frame_resp_pos -= (ch->frame_resp_pos >= ch->InEP_end) ? ch->InEP_end : 0;
+    if (ch->perf_closed_valid) {
+        perf_latency(perf.resp_latency, ch->InEP_done_time - ch->perf_closed_start);
+        ch->perf_closed_valid = 0;
+    }
+}
+
 /* Set host status, and control on-board. */
 #define PWM_HIGH (10u)
 void setStatus(STATUS status) {
@@ -413,6 +1559,913 @@ static char *toBin(uint8 b, int len) {
     return Bin_Buf;
 }
 
+/**************************************
+ * ARM JTAG-DP
+ *************************************/
+// Scan IR of the DAP if it is not selected yet.
+static void dap_select(CHANNEL *ch, uint8 ir) {
+    if (ch->dap_ir == ir) {
+        return;
+    }
+    ch->jtag->TAP_Move(11); // Shift-IR
+    ch->jtag->TAP_Scan(4 - 1, ir, 1);
+    ch->jtag->TAP_Move(1); // Run-Test/Idle
+    ch->dap_ir = ir;
+}
+
+// Scan a 35-bit DPACC/APACC request, and repeat it while the DAP answers WAIT, up to
+// dap_wait_limit times. Return the ACK, and the data captured by the scan.
+static uint8 dap_scan(CHANNEL *ch, uint8 ir, uint8 rnw, uint8 addr, uint32 *data) {
+    uint8 out[5];
+    uint8 in[5];
+    uint8 ack;
+    uint16 retry = 0;
+    uint8 dir = ch->jtag->Get_Shift_Dir();
+
+    ch->jtag->Set_Shift_Dir(LSB_FIRST);
+    dap_select(ch, ir);
+    out[0] = rnw | ((addr >> 2) << 1) | ((*data & 0x1f) << 3);
+    out[1] = (*data >> 5) & 0xff;
+    out[2] = (*data >> 13) & 0xff;
+    out[3] = (*data >> 21) & 0xff;
+    out[4] = (*data >> 29) & 0x07;
+    do {
+        ch->jtag->TAP_Move(4); // Shift-DR
+        ch->jtag->TAP_Scan_Bytes(35, out, in, 1);
+        ch->jtag->TAP_Move(1); // Run-Test/Idle, through Update-DR
+        stat_bits += 35;
+        ack = in[0] & 0x07;
+    } while (ack == DAP_ACK_WAIT && retry++ < ch->dap_wait_limit);
+    *data = (in[0] >> 3) | ((uint32)in[1] << 5) | ((uint32)in[2] << 13) | ((uint32)in[3] << 21) | ((uint32)(in[4] & 0x07) << 29);
+    ch->jtag->Set_Shift_Dir(dir);
+    return ack;
+}
+
+// Do a DP or AP register access. The result of a read is posted, so it is
+// fetched by reading DP RDBUFF. Return the ACK of the last scan.
+static uint8 dap_transfer(CHANNEL *ch, uint8 ap, uint8 rnw, uint8 addr, uint32 *data) {
+    uint8 ack = dap_scan(ch, ap ? DAP_IR_APACC : DAP_IR_DPACC, rnw, addr, data);
+    if (ack == DAP_ACK_OK && rnw) {
+        *data = 0;
+        ack = dap_scan(ch, DAP_IR_DPACC, 1, DAP_RDBUFF, data);
+    }
+    return ack;
+}
+
+// Select the AP, and set up CSW for a block transfer.
+static void memap_start(CHANNEL *ch, uint8 ap, uint32 addr, uint16 count) {
+    uint32 data = (uint32)ap << 24;
+    ch->memap.addr = addr;
+    ch->memap.left = count;
+    ch->memap.done = 0;
+    ch->memap.tar_valid = 0;
+    ch->memap.word_idx = 0;
+    ch->memap.ack = dap_scan(ch, DAP_IR_DPACC, 0, DP_SELECT, &data);
+    if (ch->memap.ack == DAP_ACK_OK) {
+        data = MEMAP_CSW;
+        ch->memap.ack = dap_scan(ch, DAP_IR_APACC, 0, AP_CSW, &data);
+    }
+}
+
+// Set TAR at the start, and where auto-increment wraps. Return 1 if TAR is written,
+// with the data captured by the scan.
+static uint8 memap_set_tar(CHANNEL *ch, uint32 *data) {
+    if (ch->memap.tar_valid && (ch->memap.addr % MEMAP_TAR_WRAP) != 0) {
+        return 0;
+    }
+    *data = ch->memap.addr;
+    ch->memap.ack = dap_scan(ch, DAP_IR_APACC, 0, AP_TAR, data);
+    ch->memap.tar_valid = 1;
+    return 1;
+}
+
+// Read words, and push them to InEP buffer. Each DRW read returns the result of the
+// previous one, so the reads are pipelined, and the last result is read from RDBUFF.
+static void memap_read(CHANNEL *ch) {
+    uint16 count = ch->memap.left;
+    uint8 pending = 0;
+    uint32 data;
+
+    while (ch->memap.left > 0 && ch->memap.ack == DAP_ACK_OK) {
+        if (memap_set_tar(ch, &data) && pending && ch->memap.ack == DAP_ACK_OK) {
+            USBFS_push_le(ch, data, 4); /* TAR write captured the previous result. */
+            ch->memap.done++;
+            pending = 0;
+        }
+        if (ch->memap.ack != DAP_ACK_OK) {
+            break;
+        }
+        data = 0;
+        ch->memap.ack = dap_scan(ch, DAP_IR_APACC, 1, AP_DRW, &data);
+        if (ch->memap.ack != DAP_ACK_OK) {
+            break;
+        }
+        if (pending) {
+            USBFS_push_le(ch, data, 4);
+            ch->memap.done++;
+        }
+        pending = 1;
+        ch->memap.addr += 4;
+        ch->memap.left--;
+    }
+    if (pending && ch->memap.ack == DAP_ACK_OK) {
+        data = 0;
+        ch->memap.ack = dap_scan(ch, DAP_IR_DPACC, 1, DAP_RDBUFF, &data);
+        if (ch->memap.ack == DAP_ACK_OK) {
+            USBFS_push_le(ch, data, 4);
+            ch->memap.done++;
+        }
+    }
+    for (uint16 k = ch->memap.done; k < count; k++) {
+        USBFS_push_le(ch, 0, 4);
+    }
+}
+
+// Write the words in the given buffer, and return the number of bytes consumed.
+// A word split at the end of the buffer is resumed by the next call. After an
+// error, the rest of the words are skipped.
+static uint16 memap_write(CHANNEL *ch, const uint8 *buf, uint16 len) {
+    uint16 i = 0;
+    uint32 data;
+    while (i < len && ch->memap.left > 0) {
+        ch->memap.word[ch->memap.word_idx++] = buf[i++];
+        if (ch->memap.word_idx < 4) {
+            continue;
+        }
+        ch->memap.word_idx = 0;
+        ch->memap.left--;
+        if (ch->memap.ack != DAP_ACK_OK) {
+            continue;
+        }
+        memap_set_tar(ch, &data);
+        if (ch->memap.ack == DAP_ACK_OK) {
+            data = get_le(ch->memap.word, 4);
+            ch->memap.ack = dap_scan(ch, DAP_IR_APACC, 0, AP_DRW, &data);
+        }
+        if (ch->memap.ack == DAP_ACK_OK) {
+            ch->memap.done++;
+            ch->memap.addr += 4;
+        }
+    }
+    if (ch->memap.left == 0) {
+        ch->parser->state = PARSE_CMD;
+        memap_finish(ch, 1);
+    }
+    return i;
+}
+
+// Push the result of a block transfer. The last write is checked by reading RDBUFF.
+static void memap_finish(CHANNEL *ch, uint8 write) {
+    uint32 data = 0;
+    if (write && ch->memap.ack == DAP_ACK_OK) {
+        ch->memap.ack = dap_scan(ch, DAP_IR_DPACC, 1, DAP_RDBUFF, &data);
+    }
+    USBFS_push_byte(ch, ch->memap.ack);
+    USBFS_push_le(ch, ch->memap.done, 2);
+}
+
+/**************************************
+ * XSVF player
+ *************************************/
+// XSVF instructions. (Xilinx XAPP503)
+#define XCOMPLETE (0)
+#define XTDOMASK (1)
+#define XSIR (2)
+#define XSDR (3)
+#define XRUNTEST (4)
+#define XREPEAT (7)
+#define XSDRSIZE (8)
+#define XSDRTDO (9)
+#define XSDRB (12)
+#define XSDRC (13)
+#define XSDRE (14)
+#define XSDRTDOB (15)
+#define XSDRTDOC (16)
+#define XSDRTDOE (17)
+#define XSTATE (18)
+#define XENDIR (19)
+#define XENDDR (20)
+#define XSIR2 (21)
+#define XCOMMENT (22)
+#define XWAIT (23)
+
+#define TAP_RTI (1)
+#define TAP_SHIFT_DR (4)
+#define TAP_PAUSE_DR (6)
+#define TAP_SHIFT_IR (11)
+#define TAP_PAUSE_IR (13)
+
+static uint32 get_be(const uint8 *buf, uint8 len) {
+    uint32 val = 0;
+    for (uint8 i = 0; i < len; i++) {
+        val = (val << 8) | buf[i];
+    }
+    return val;
+}
+
+// Reset the player for a new XSVF file.
+static void xsvf_start(CHANNEL *ch) {
+    ch->xsvf.status = XSVF_OK;
+    ch->xsvf.inst = XSVF_NONE;
+    ch->xsvf.sdr_bits = 0;
+    ch->xsvf.runtest = 0;
+    ch->xsvf.repeat = 0;
+    ch->xsvf.endir = TAP_RTI;
+    ch->xsvf.enddr = TAP_RTI;
+    ch->xsvf.inst_count = 0;
+    memset(ch->xsvf.tdo_mask, 0xff, sizeof(ch->xsvf.tdo_mask));
+    memset(ch->xsvf.tdo_exp, 0, sizeof(ch->xsvf.tdo_exp));
+}
+
+static void xsvf_error(CHANNEL *ch, uint8 status) {
+    ch->xsvf.status = status;
+    TRACE(TR_XSVF_ERROR, status, ch->xsvf.inst, 0);
+}
+
+// Set the operand to read.
+static uint8 xsvf_vector(CHANNEL *ch, uint8 *dest, uint32 bits) {
+    if ((bits + 7) / 8 > XSVF_MAX_BYTES) {
+        xsvf_error(ch, XSVF_ERR_SIZE);
+        return 0;
+    }
+    ch->xsvf.dest = dest;
+    ch->xsvf.len = (bits + 7) / 8;
+    ch->xsvf.reverse = 1;
+    return 1;
+}
+static uint8 xsvf_scalar(CHANNEL *ch, uint16 len) {
+    ch->xsvf.dest = ch->xsvf.arg;
+    ch->xsvf.len = len;
+    ch->xsvf.reverse = 0;
+    return 1;
+}
+// Set the next operand of the instruction. Return 0 if it has no more operands.
+static uint8 xsvf_operand(CHANNEL *ch) {
+    uint8 f = ch->xsvf.field;
+    ch->xsvf.idx = 0;
+    switch (ch->xsvf.inst) {
+    case XTDOMASK:
+        return (f == 0) ? xsvf_vector(ch, ch->xsvf.tdo_mask, ch->xsvf.sdr_bits) : 0;
+    case XSIR:
+        return (f == 0) ? xsvf_scalar(ch, 1) : (f == 1) ? xsvf_vector(ch, ch->xsvf.tdi, ch->xsvf.arg[0]) : 0;
+    case XSIR2:
+        return (f == 0) ? xsvf_scalar(ch, 2) : (f == 1) ? xsvf_vector(ch, ch->xsvf.tdi, get_be(ch->xsvf.arg, 2)) : 0;
+    case XSDR:
+    case XSDRB:
+    case XSDRC:
+    case XSDRE:
+        return (f == 0) ? xsvf_vector(ch, ch->xsvf.tdi, ch->xsvf.sdr_bits) : 0;
+    case XSDRTDO:
+    case XSDRTDOB:
+    case XSDRTDOC:
+    case XSDRTDOE:
+        return (f == 0) ? xsvf_vector(ch, ch->xsvf.tdi, ch->xsvf.sdr_bits) : (f == 1) ? xsvf_vector(ch, ch->xsvf.tdo_exp, ch->xsvf.sdr_bits) : 0;
+    case XRUNTEST:
+    case XSDRSIZE:
+        return (f == 0) ? xsvf_scalar(ch, 4) : 0;
+    case XREPEAT:
+    case XSTATE:
+    case XENDIR:
+    case XENDDR:
+        return (f == 0) ? xsvf_scalar(ch, 1) : 0;
+    case XWAIT:
+        return (f == 0) ? xsvf_scalar(ch, 6) : 0;
+    case XCOMMENT:
+        return (f == 0 || ch->xsvf.arg[0] != 0) ? xsvf_scalar(ch, 1) : 0; /* Until the terminating NUL. */
+    default:
+        return 0;
+    }
+}
+
+// Stay in the current state for usec. TCK is clocked in Run-Test/Idle.
+static void xsvf_wait(CHANNEL *ch, uint32 usec) {
+    uint32 khz = CLK_JTAG_KHZ / ch->clk_div + 1; /* Round up not to cut the wait short. */
+    uint32 clocks;
+    if ((ch->jtag->TAP_Get_State() & 0x0f) == TAP_RTI) {
+        if (usec / 1000 > 0xffffffffu / khz - 1) {
+            clocks = 0xffffffffu;
+        } else {
+            clocks = usec / 1000 * khz + (usec % 1000) * khz / 1000 + 1;
+        }
+        ch->jtag->Clock_Burst_Start(clocks);
+        while (ch->jtag->Clock_Burst_Poll()) {
+        }
+    } else {
+        CyDelay(usec / 1000);
+        CyDelayUs(usec % 1000);
+    }
+}
+
+// Shift the DR vector CMP_CHUNK bytes at a time, comparing the TDO of each chunk as
+// it is captured. Return nonzero on mismatch.
+static uint8 xsvf_scan_dr(CHANNEL *ch, uint8 end, uint8 compare) {
+    uint8 tdo[CMP_CHUNK];
+    uint16 n = (ch->xsvf.sdr_bits + 7) / 8;
+    uint16 pos = 0;
+    uint16 len;
+    uint8 last;
+    uint8 mismatch = 0;
+    do {
+        len = MIN(n - pos, CMP_CHUNK);
+        last = (pos + len == n);
+        ch->jtag->TAP_Scan_Bytes(last ? ch->xsvf.sdr_bits - pos * 8u : len * 8u, ch->xsvf.tdi + pos, compare ? tdo : NULL, end && last);
+        for (uint16 k = 0; compare && k < len; k++) {
+            mismatch |= (tdo[k] ^ ch->xsvf.tdo_exp[pos + k]) & ch->xsvf.tdo_mask[pos + k];
+        }
+        pos += len;
+    } while (!last);
+    stat_bits += ch->xsvf.sdr_bits;
+    return mismatch;
+}
+
+// Shift the DR vector, compare TDO, and retry up to XREPEAT times on mismatch.
+static void xsvf_shift_dr(CHANNEL *ch, uint8 start, uint8 end, uint8 compare, uint32 runtest, uint8 repeat) {
+    uint8 mismatch;
+    uint8 retry;
+    for (;;) {
+        if (start) {
+            ch->jtag->TAP_Move(TAP_SHIFT_DR);
+        }
+        mismatch = xsvf_scan_dr(ch, end, compare);
+        retry = mismatch && end && repeat > 0 && runtest > 0;
+        if (retry) {
+            // Retry through Pause-DR with 25% longer RUNTEST. (as the XAPP503 player does)
+            repeat--;
+            ch->jtag->TAP_Move(TAP_PAUSE_DR);
+            ch->jtag->TAP_Move(TAP_SHIFT_DR);
+            runtest += runtest >> 2;
+        } else if (end) {
+            ch->jtag->TAP_Move(ch->xsvf.enddr);
+        }
+        if (end && runtest > 0) {
+            ch->jtag->TAP_Move(TAP_RTI);
+            xsvf_wait(ch, runtest);
+        }
+        if (!retry) {
+            break;
+        }
+    }
+    if (mismatch) {
+        xsvf_error(ch, XSVF_ERR_TDO);
+    }
+}
+
+// Execute the instruction whose operands are all read.
+static void xsvf_execute(CHANNEL *ch) {
+    switch (ch->xsvf.inst) {
+    case XCOMPLETE:
+        ch->xsvf.status = XSVF_DONE;
+        break;
+    case XTDOMASK:
+    case XCOMMENT:
+        break;
+    case XSIR:
+    case XSIR2:
+        ch->jtag->TAP_Move(TAP_SHIFT_IR);
+        ch->jtag->TAP_Scan_Bytes((ch->xsvf.inst == XSIR) ? ch->xsvf.arg[0] : get_be(ch->xsvf.arg, 2), ch->xsvf.tdi, NULL, 1);
+        ch->jtag->TAP_Move(ch->xsvf.endir);
+        // As the XAPP503 player does, RUNTEST is waited in Run-Test/Idle whatever XENDIR is.
+        if (ch->xsvf.runtest > 0) {
+            ch->jtag->TAP_Move(TAP_RTI);
+            xsvf_wait(ch, ch->xsvf.runtest);
+        }
+        break;
+    case XSDR:
+    case XSDRTDO:
+        xsvf_shift_dr(ch, 1, 1, 1, ch->xsvf.runtest, ch->xsvf.repeat);
+        break;
+    case XSDRB:
+        xsvf_shift_dr(ch, 1, 0, 0, 0, 0);
+        break;
+    case XSDRC:
+        xsvf_shift_dr(ch, 0, 0, 0, 0, 0);
+        break;
+    case XSDRE:
+        xsvf_shift_dr(ch, 0, 1, 0, 0, 0);
+        break;
+    case XSDRTDOB:
+        xsvf_shift_dr(ch, 1, 0, 1, 0, 0);
+        break;
+    case XSDRTDOC:
+        xsvf_shift_dr(ch, 0, 0, 1, 0, 0);
+        break;
+    case XSDRTDOE:
+        xsvf_shift_dr(ch, 0, 1, 1, 0, 0);
+        break;
+    case XRUNTEST:
+        ch->xsvf.runtest = get_be(ch->xsvf.arg, 4);
+        break;
+    case XREPEAT:
+        ch->xsvf.repeat = ch->xsvf.arg[0];
+        break;
+    case XSDRSIZE:
+        ch->xsvf.sdr_bits = get_be(ch->xsvf.arg, 4);
+        if ((ch->xsvf.sdr_bits + 7) / 8 > XSVF_MAX_BYTES) {
+            xsvf_error(ch, XSVF_ERR_SIZE);
+        }
+        break;
+    case XSTATE:
+        if (ch->xsvf.arg[0] == 0) {
+            ch->jtag->TAP_Reset();
+        } else {
+            ch->jtag->TAP_Move(ch->xsvf.arg[0] & 0x0f);
+        }
+        break;
+    case XENDIR:
+        ch->xsvf.endir = (ch->xsvf.arg[0] != 0) ? TAP_PAUSE_IR : TAP_RTI;
+        break;
+    case XENDDR:
+        ch->xsvf.enddr = (ch->xsvf.arg[0] != 0) ? TAP_PAUSE_DR : TAP_RTI;
+        break;
+    case XWAIT:
+        ch->jtag->TAP_Move(ch->xsvf.arg[0] & 0x0f);
+        xsvf_wait(ch, get_be(ch->xsvf.arg + 2, 4));
+        ch->jtag->TAP_Move(ch->xsvf.arg[1] & 0x0f);
+        break;
+    default:
+        xsvf_error(ch, XSVF_ERR_UNSUPPORTED);
+        return;
+    }
+    ch->xsvf.inst_count++;
+}
+
+// Play an XSVF chunk, and return the number of bytes consumed. An instruction split
+// at the end of the chunk is resumed by the next one. After XCOMPLETE or an error,
+// the rest of the file is skipped.
+static uint16 xsvf_input(CHANNEL *ch, const uint8 *buf, uint16 len) {
+    uint8 dir = ch->jtag->Get_Shift_Dir();
+    uint16 i = 0;
+
+    ch->jtag->Set_Shift_Dir(LSB_FIRST); /* Vectors are stored from the last byte, and shifted from its LSB. */
+    while (i < len && ch->xsvf.status == XSVF_OK) {
+        if (ch->xsvf.inst == XSVF_NONE) {
+            ch->xsvf.inst = buf[i++];
+            ch->xsvf.field = 0;
+        } else {
+            ch->xsvf.dest[ch->xsvf.reverse ? ch->xsvf.len - 1 - ch->xsvf.idx : ch->xsvf.idx] = buf[i++];
+            ch->xsvf.idx++;
+            if (ch->xsvf.idx < ch->xsvf.len) {
+                continue;
+            }
+            ch->xsvf.field++;
+        }
+        // Skip empty operands, and execute the instruction after the last one.
+        for (;;) {
+            if (!xsvf_operand(ch)) {
+                if (ch->xsvf.status == XSVF_OK) {
+                    xsvf_execute(ch);
+                }
+                ch->xsvf.inst = XSVF_NONE;
+                break;
+            }
+            if (ch->xsvf.len > 0) {
+                break;
+            }
+            ch->xsvf.field++;
+        }
+    }
+    ch->jtag->Set_Shift_Dir(dir);
+    return len;
+}
+
+/**************************************
+ * Macros
+ *************************************/
+// Store the body of the macro being defined, and return the number of bytes consumed.
+// The body of an invalid definition is consumed and dropped.
+static uint16 macro_define(CHANNEL *ch, const uint8 *buf, uint16 len) {
+    MACRO *m = (ch->parser->macro_id < MACRO_SLOTS) ? &ch->macros[ch->parser->macro_id] : NULL;
+    uint8 valid = m != NULL && ch->parser->hdr[1] > 0 && ch->parser->hdr[1] <= MACRO_MAX_BYTES;
+    uint16 n = MIN(len, ch->parser->macro_left);
+    if (valid && n > 0) {
+        memcpy(m->body + ch->parser->hdr[1] - ch->parser->macro_left, buf, n);
+    }
+    ch->parser->macro_left -= n;
+    if (ch->parser->macro_left == 0) {
+        ch->parser->state = PARSE_CMD;
+        if (valid) {
+            m->len = ch->parser->hdr[1];
+        }
+        USBFS_push_byte(ch, valid ? MACRO_OK : MACRO_ERR_ID);
+    }
+    return n;
+}
+
+// Patch the arguments into a macro, and run it. Its output goes to InEP buffer.
+static uint8 macro_run(CHANNEL *ch, uint8 id, const uint8 *args) {
+    MACRO *m;
+    uint8 a;
+    uint16 n;
+    if (id >= MACRO_SLOTS || ch->macros[id].len == 0) {
+        return MACRO_ERR_ID;
+    }
+    m = &ch->macros[id];
+    for (a = 0; a < MACRO_ARGS; a++) {
+        if (m->param[a] < m->len) {
+            m->body[m->param[a]] = args[a];
+        }
+    }
+    ch->macro_running = 1;
+    ch->macro_parser.state = PARSE_CMD;
+    ch->parser = &ch->macro_parser;
+    n = parse_commands(ch, m->body, m->len);
+    ch->parser = &ch->host_parser;
+    ch->macro_running = 0;
+    if (ch->macro_abort || n != m->len || ch->macro_parser.state != PARSE_CMD) {
+        ch->macro_abort = 0; /* The body ends in the middle of a command. */
+        return MACRO_ERR_BODY;
+    }
+    return MACRO_OK;
+}
+
+// Run a macro repeatedly until a TDO bit of its output matches, for status polling.
+// hdr: ID, argument bytes, the bit offset in the output (16 bits), the expected
+// value (bit0) and the maximum number of runs (16 bits).
+// Only the output of the last run is kept, followed by the status (MACRO_STATUS)
+// and the number of runs (16 bits).
+static void macro_poll(CHANNEL *ch, const uint8 *hdr) {
+    uint8 id = hdr[0];
+    uint16 bit = get_le(hdr + 1 + MACRO_ARGS, 2);
+    uint8 expect = hdr[3 + MACRO_ARGS] & 1;
+    uint16 limit = get_le(hdr + 4 + MACRO_ARGS, 2);
+    uint16 runs = 0;
+    uint8 status = MACRO_ERR_TIMEOUT;
+    uint32 in_bytes, overflow;
+    uint16 out_len, out_pos;
+    uint8 intr_state;
+
+    DP2("CMD 15: Poll macro %u => bit %u == %u, %u runs\n", id, bit, expect, limit);
+    while (runs < limit) {
+        in_bytes = stat_in_bytes;
+        overflow = ch->usb_in_overflow;
+        status = macro_run(ch, id, hdr + 1);
+        runs++;
+        if (status != MACRO_OK) {
+            break;
+        }
+        out_len = stat_in_bytes - in_bytes;
+        status = MACRO_ERR_TIMEOUT;
+        /* IN EP ISR must not send the output between the check and the drop. */
+        intr_state = CyEnterCriticalSection();
+        out_pos = ch->InEP_buf_idx - out_len;
+        if (bit / 8 >= out_len || ch->usb_in_overflow != overflow || out_len > ch->InEP_buf_idx || out_pos < ch->InEP_buf_sent ||
+            ((ch->session_flags & SESSION_FRAMED) && out_pos < ch->frame_resp_pos + FRAME_HDR_SIZE)) {
+            status = MACRO_ERR_BODY; /* The bit is not in the output, or the output is already sent. */
+        } else if (((ch->InEP_buf[out_pos + bit / 8] >> (bit % 8)) & 1) == expect) {
+            status = MACRO_OK;
+        } else if (runs < limit) {
+            ch->InEP_buf_idx = out_pos; /* Drop the output of this run. */
+            stat_in_bytes = in_bytes;
+        }
+        CyExitCriticalSection(intr_state);
+        if (status != MACRO_ERR_TIMEOUT) {
+            break;
+        }
+    }
+    USBFS_push_byte(ch, status);
+    USBFS_push_le(ch, runs, 2);
+}
+
+/**************************************
+ * TCK calibration
+ *************************************/
+// Return pseudo-random TDI bits.
+static uint8 cal_random(void) {
+    cal_prbs ^= cal_prbs << 13;
+    cal_prbs ^= cal_prbs >> 17;
+    cal_prbs ^= cal_prbs << 5;
+    return cal_prbs & 0xff;
+}
+
+// Read the first 32 bits of DR after Test-Logic-Reset, which is the IDCODE of
+// the TAP nearest to TDO.
+static uint32 cal_idcode(CHANNEL *ch) {
+    uint8 tdi[4] = {0};
+    uint8 tdo[4];
+    ch->jtag->TAP_Reset();
+    ch->jtag->TAP_Move(4); /* Shift-DR */
+    ch->jtag->TAP_Scan_Bytes(32, tdi, tdo, 1);
+    ch->jtag->TAP_Move(1); /* Run-Test/Idle */
+    return get_le(tdo, 4);
+}
+
+// Select BYPASS on every TAP by filling the IR chain with ones.
+static void cal_bypass(CHANNEL *ch) {
+    uint8 ones[CAL_IR_BYTES];
+    memset(ones, 0xff, sizeof(ones));
+    ch->jtag->TAP_Move(11); /* Shift-IR */
+    ch->jtag->TAP_Scan_Bytes(CAL_IR_BYTES * 8, ones, NULL, 1);
+    ch->jtag->TAP_Move(1);
+}
+
+// Return the number of TAPs in BYPASS, which delay TDO by 1 bit each.
+// Returns CAL_MAX_TAPS + 1 if the chain is broken or too long.
+static uint8 cal_chain_length(CHANNEL *ch) {
+    uint8 tdi[CAL_MAX_TAPS / 4];
+    uint8 tdo[CAL_MAX_TAPS / 4];
+    uint16 k;
+    memset(tdi, 0, CAL_MAX_TAPS / 8);
+    memset(tdi + CAL_MAX_TAPS / 8, 0xff, CAL_MAX_TAPS / 8);
+    ch->jtag->TAP_Move(4);
+    ch->jtag->TAP_Scan_Bytes(CAL_MAX_TAPS * 2, tdi, tdo, 1);
+    ch->jtag->TAP_Move(1);
+    // Zeros flush the chain, and the first one comes out after the TAPs.
+    for (k = 0; k < CAL_MAX_TAPS * 2; k++) {
+        if ((tdo[k / 8] >> (k % 8)) & 1) {
+            return (k >= CAL_MAX_TAPS) ? k - CAL_MAX_TAPS : CAL_MAX_TAPS + 1;
+        }
+    }
+    return CAL_MAX_TAPS + 1;
+}
+
+// Shift pseudo-random bits through the BYPASS chain, and return 1 if they come back intact.
+static uint8 cal_loopback(CHANNEL *ch, uint8 taps) {
+    uint8 tdi[CAL_PRBS_BYTES + CAL_MAX_TAPS / 8 + 1];
+    uint8 tdo[CAL_PRBS_BYTES + CAL_MAX_TAPS / 8 + 1];
+    uint16 k;
+    for (k = 0; k < sizeof(tdi); k++) {
+        tdi[k] = cal_random();
+    }
+    ch->jtag->TAP_Move(4);
+    ch->jtag->TAP_Scan_Bytes(CAL_PRBS_BYTES * 8 + taps, tdi, tdo, 1);
+    ch->jtag->TAP_Move(1);
+    for (k = 0; k < CAL_PRBS_BYTES * 8; k++) {
+        if (((tdi[k / 8] >> (k % 8)) ^ (tdo[(k + taps) / 8] >> ((k + taps) % 8))) & 1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Step the divider from fastest to slowest until one passes the given number of
+// iterations without error, and set it. The reference IDCODE and the chain length
+// are taken at the slowest divider. If the ladder of about 25% steps does not reach
+// the slowest divider in CAL_MAX_SPEEDS steps, its last step goes straight there.
+// The divider is restored if none passes.
+static void tck_calibrate(CHANNEL *ch, uint16 fastest, uint16 slowest, uint8 iterations) {
+    uint16 saved_div = ch->clk_div;
+    uint8 dir = ch->jtag->Get_Shift_Dir();
+    uint8 status = CAL_ERR_NONE;
+    uint8 speeds = 0;
+    uint32 div = 0;
+    uint32 idcode;
+    uint8 taps;
+    uint8 errors;
+    uint8 k;
+
+    fastest = MAX(fastest, 1);
+    slowest = MAX(slowest, fastest);
+    iterations = MAX(iterations, 1);
+    ch->jtag->Set_Shift_Dir(LSB_FIRST);
+    set_clock_divider(ch, slowest);
+    idcode = cal_idcode(ch);
+    cal_bypass(ch);
+    taps = cal_chain_length(ch);
+    if (idcode == 0 || idcode == 0xffffffffu || taps > CAL_MAX_TAPS) {
+        status = CAL_ERR_CHAIN; /* TDO is stuck, or the chain is broken. */
+    } else {
+        // The last slot is the slowest divider, which always gets tried.
+        for (div = fastest; speeds < CAL_MAX_SPEEDS; div = (speeds < CAL_MAX_SPEEDS - 1) ? MIN(div + MAX(div / 4, 1u), slowest) : slowest) {
+            set_clock_divider(ch, div);
+            errors = 0;
+            for (k = 0; k < iterations; k++) {
+                if (cal_idcode(ch) != idcode) {
+                    errors++;
+                    continue;
+                }
+                cal_bypass(ch);
+                if (!cal_loopback(ch, taps)) {
+                    errors++;
+                }
+            }
+            cal_div[speeds] = div;
+            cal_errors[speeds++] = errors;
+            if (errors == 0) {
+                status = CAL_OK;
+                break;
+            }
+            if (div == slowest) {
+                break;
+            }
+        }
+    }
+    DP2("=> status %u, %u speeds, div %lu\n", status, speeds, div);
+    set_clock_divider(ch, (status == CAL_OK) ? div : saved_div);
+    ch->jtag->Set_Shift_Dir(dir);
+    ch->jtag->TAP_Reset();
+
+    USBFS_push_byte(ch, status);
+    USBFS_push_le(ch, (status == CAL_OK) ? div : 0, 2);
+    USBFS_push_byte(ch, speeds);
+    for (k = 0; k < speeds; k++) {
+        USBFS_push_le(ch, cal_div[k], 2);
+        USBFS_push_byte(ch, cal_errors[k]);
+    }
+}
+
+/**************************************
+ * Performance counters
+ *************************************/
+// Cycle counter (DWT) of Cortex-M3.
+static void cycle_counter_start(void) {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+static void perf_reset(void) {
+    memset(&perf, 0, sizeof(perf));
+    perf_last = DWT->CYCCNT;
+    perf_base[0] = stat_bits;
+    perf_base[1] = stat_in_bytes;
+    perf_base[2] = jtag_wait_cycles();
+    perf_base[3] = in_overflow_bytes();
+}
+
+// Return the cycles spent waiting for the datapaths of all chains.
+static uint32 jtag_wait_cycles(void) {
+    uint32 cycles = 0;
+    for (uint8 c = 0; c < CHANNELS; c++) {
+        cycles += channels[c].jtag->Get_Wait_Cycles();
+    }
+    return cycles;
+}
+
+// Return the TDO bytes lost by InEP buffer overflow on all channels.
+static uint32 in_overflow_bytes(void) {
+    uint32 bytes = 0;
+    for (uint8 c = 0; c < CHANNELS; c++) {
+        bytes += channels[c].usb_in_overflow;
+    }
+    return bytes;
+}
+
+// Add a latency to a log2 histogram of microseconds.
+static void perf_latency(uint32 *hist, uint32 cycles) {
+    uint32 us = cycles / (BCLK__BUS_CLK__HZ / 1000000u);
+    uint8 n = 0;
+    while (us > 1 && n < PERF_BUCKETS - 1) {
+        us >>= 1;
+        n++;
+    }
+    hist[n]++;
+}
+
+// Take a snapshot of the counters for JTAG_PERF request.
+static void perf_snapshot(void) {
+    perf.bits = stat_bits - perf_base[0];
+    perf.in_bytes = stat_in_bytes - perf_base[1];
+    perf.jtag_wait_cycles = jtag_wait_cycles() - perf_base[2];
+    perf.in_overflow = in_overflow_bytes() - perf_base[3];
+    perf_report = perf;
+}
+
+/**************************************
+ * Benchmark
+ *************************************/
+// Replay canned OpenOCD traffic through parse_commands() and report throughput.
+// TCK duty is the time TCK would need for the scanned bits over the elapsed time.
+// TDO goes to InEP_buf behind any pending data and is discarded after each batch.
+#define BENCH_ITERATIONS (100u)
+#define BENCH_DR_BYTES (250u)
+
+// IDCODE read: IR scan of 4 bits, then DR scan of 32 bits.
+static uint16 bench_idcode(uint8 *buf) {
+    uint16 n = 0;
+    buf[n++] = 0x01 | (11 << 4); // Shift-IR
+    buf[n++] = 0x06 | (((4 - 1) << 1 | 1) << 4);
+    buf[n++] = 0x01;
+    buf[n++] = 0x01 | (1 << 4); // Run-Test/Idle
+    buf[n++] = 0x01 | (4 << 4); // Shift-DR
+    for (int i = 0; i < 4; i++) {
+        buf[n++] = 0x06 | (((8 - 1) << 1 | (i == 3)) << 4);
+        buf[n++] = 0x00;
+    }
+    buf[n++] = 0x01 | (1 << 4); // Run-Test/Idle
+    return n;
+}
+
+// IDCODE with CMD 14.
+static uint16 bench_idcode_fused(uint8 *buf) {
+    uint16 n = 0;
+    buf[n++] = 0x0e | (1 << 4); // IR, capture
+    buf[n++] = 1;               // Run-Test/Idle
+    buf[n++] = 4;
+    buf[n++] = 0;
+    buf[n++] = 0x01;
+    buf[n++] = 0x0e | (0 << 4); // DR, capture
+    buf[n++] = 1;               // Run-Test/Idle
+    buf[n++] = 32;
+    buf[n++] = 0;
+    for (int i = 0; i < 4; i++) {
+        buf[n++] = 0x00;
+    }
+    return n;
+}
+
+// Flash programming: long DR scan, then idle clocks.
+static uint16 bench_dr_write(uint8 *buf) {
+    uint16 n = 0;
+    buf[n++] = 0x01 | (4 << 4); // Shift-DR
+    for (uint16 i = 0; i < BENCH_DR_BYTES; i++) {
+        buf[n++] = 0x06 | (((8 - 1) << 1 | (i == BENCH_DR_BYTES - 1)) << 4);
+        buf[n++] = (uint8)i;
+    }
+    buf[n++] = 0x01 | (1 << 4); // Run-Test/Idle
+    buf[n++] = 0x07 | (15 << 4);
+    return n;
+}
+
+// Flash programming by long shift command.
+static uint16 bench_dr_write_long(uint8 *buf) {
+    uint16 n = 0;
+    buf[n++] = 0x01 | (4 << 4); // Shift-DR
+    buf[n++] = 0x08 | (1 << 4); // last TMS, 16-bit bit count
+    buf[n++] = (BENCH_DR_BYTES * 8) & 0xff;
+    buf[n++] = (BENCH_DR_BYTES * 8) >> 8;
+    for (uint16 i = 0; i < BENCH_DR_BYTES; i++) {
+        buf[n++] = (uint8)i;
+    }
+    buf[n++] = 0x01 | (1 << 4); // Run-Test/Idle
+    buf[n++] = 0x07 | (15 << 4);
+    return n;
+}
+
+static uint16 bench_dr_write_nocap(uint8 *buf) {
+    uint16 n = bench_dr_write_long(buf);
+    buf[1] |= (4 << 4); // no TDO capture
+    return n;
+}
+
+#define BENCH_BUF_SIZE (512u)
+uint8 bench_buf[BENCH_BUF_SIZE];
+static void bench_run(CHANNEL *ch, const char *name, uint16 (*gen)(uint8 *buf)) {
+    uint16 saved_InEP_buf_idx = ch->InEP_buf_idx;
+    PARSER saved_parser = *ch->parser;
+    uint32 out_bytes = 0;
+    uint32 cycles = 0;
+    uint32 start;
+    uint32 saved_stat[3] = {stat_cmds, stat_bits, stat_in_bytes};
+    PERF saved_perf = perf;
+    uint32 saved_wait = ch->jtag->Get_Wait_Cycles();
+    uint32 rle_bytes = 0;
+    uint16 rle_len;
+    uint16 n;
+
+    stat_cmds = 0;
+    stat_bits = 0;
+    stat_in_bytes = 0;
+    ch->jtag->TAP_Reset();
+    for (uint16 k = 0; k < BENCH_ITERATIONS; k++) {
+        uint16 len = gen(bench_buf);
+        ch->parser->state = PARSE_CMD;
+        start = DWT->CYCCNT;
+        parse_commands(ch, bench_buf, len);
+        cycles += DWT->CYCCNT - start;
+        out_bytes += len;
+        // As frame_close() does, count the raw length unless encoding makes it shorter.
+        n = ch->InEP_buf_idx - saved_InEP_buf_idx;
+        rle_len = rle_encode(ch->InEP_buf + saved_InEP_buf_idx, n, rle_buf, n - 1);
+        rle_bytes += (rle_len != 0) ? rle_len : n;
+        ch->InEP_buf_idx = saved_InEP_buf_idx;
+    }
+    *ch->parser = saved_parser;
+
+    float sec = (float)cycles / BCLK__BUS_CLK__HZ;
+    DP("%s: %lu cmds, %lu bits, %lu cycles\n", name, stat_cmds, stat_bits, cycles);
+    DP("  %.0f cmds/s, %.0f bits/s\n", stat_cmds / sec, stat_bits / sec);
+    // The payload is the TDI bytes of the shifted bits and the TDO bytes returned.
+    DP("  USB %lu OUT + %lu IN bytes, %.3f overhead bytes/bit\n", out_bytes, stat_in_bytes, ((float)out_bytes - stat_bits / 8.0f) / stat_bits);
+    DP("  TCK duty %.1f%%\n", 100.0f * stat_bits / (CLK_JTAG_KHZ * 1000.0f / ch->clk_div) / sec);
+    // Each batch is 2 control transfers + bulk packets in the legacy protocol,
+    // and only bulk packets with the frame headers in the self-framed protocol.
+    uint32 in_len = stat_in_bytes / BENCH_ITERATIONS;
+    uint32 legacy = 2 + (out_bytes / BENCH_ITERATIONS + EP_SIZE - 1) / EP_SIZE + in_len / EP_SIZE + 1;
+    uint32 framed = (out_bytes / BENCH_ITERATIONS + FRAME_HDR_SIZE + EP_SIZE - 1) / EP_SIZE + (in_len + FRAME_HDR_SIZE) / EP_SIZE + 1;
+    DP("  USB transfers/batch: legacy %lu, framed %lu\n", legacy, framed);
+    DP("  RLE IN bytes %lu (%.1f%%)\n", rle_bytes, stat_in_bytes ? 100.0f * rle_bytes / stat_in_bytes : 100.0f);
+
+    // The canned traffic is not counted as USB traffic.
+    stat_cmds = saved_stat[0];
+    stat_bits = saved_stat[1];
+    stat_in_bytes = saved_stat[2];
+    perf = saved_perf;
+    perf_base[2] += ch->jtag->Get_Wait_Cycles() - saved_wait;
+}
+
+static void run_benchmark(CHANNEL *ch) {
+    if (ch->USB_Read_Request_Len != 0 || !OUT_RING_EMPTY(ch) || ch->frame_hdr_idx != 0 || ch->frame_ready || ch->rti_burst) {
+        DP("USB transfer in progress.\n");
+        return;
+    }
+    DP("TCK %.1fkHz\n", (float)CLK_JTAG_KHZ / ch->clk_div);
+    bench_run(ch, "IDCODE", bench_idcode);
+    bench_run(ch, "IDCODE (CMD 14)", bench_idcode_fused);
+    bench_run(ch, "DR write", bench_dr_write);
+    bench_run(ch, "DR write (CMD 8)", bench_dr_write_long);
+    bench_run(ch, "DR write (CMD 8, no capture)", bench_dr_write_nocap);
+}
+
 /**************************************
  * USBFS Vendor Request Callbacks
  *************************************/
@@ -420,42 +2473,113 @@ static char *toBin(uint8 b, int len) {
 #define JTAG_DISABLE 0xD1 /* bRequest: disable JTAG */
 #define JTAG_READ 0xD2    /* bRequest: read buffer */
 #define JTAG_WRITE 0xD3   /* bRequest: write buffer */
+#define JTAG_PERF 0xD4    /* bRequest: read performance counters */
 #define USB_TIMEOUT 100
 uint16 wValue, wIndex;
 uint8 USBFS_HandleVendorRqst_Callback() {
     uint8 requestHandled = USBFS_FALSE;
+    CHANNEL *ch;
 
     wValue = CY_GET_REG16(USBFS_wValue);
     wIndex = CY_GET_REG16(USBFS_wIndex);
 
+    /* wIndex selects the channel. JTAG_PERF is of the whole device. */
+    if (wIndex >= CHANNELS && CY_GET_REG8(USBFS_bRequest) != JTAG_PERF) {
+        return USBFS_FALSE;
+    }
+    ch = &channels[(wIndex < CHANNELS) ? wIndex : 0];
+
     /* Based on the bRequest sent, perform the proper action */
     switch (CY_GET_REG8(USBFS_bRequest)) {
     case JTAG_ENABLE:
+        // Here, wValue indicates the session options. (SESSION_*)
+        ch->session_flags = wValue;
+        ch->frame_hdr_idx = 0;
+        ch->frame_ready = 0;
         requestHandled = USBFS_InitNoDataControlTransfer();
         break;
     case JTAG_DISABLE:
+        ch->session_flags = 0;
         requestHandled = USBFS_InitNoDataControlTransfer();
         break;
     case JTAG_READ:
         // Here, wValue indicates the size of the next bulk read.
-        USB_Read_Request_Len += wValue;
+        ch->USB_Read_Request_Len += wValue;
         requestHandled = USBFS_InitNoDataControlTransfer();
         break;
     case JTAG_WRITE:
         // Here, wValue indicates the size of the next bulk write.
-        USB_Write_Request_Len += wValue;
+        ch->USB_Write_Request_Len += wValue;
         requestHandled = USBFS_InitNoDataControlTransfer();
         break;
+    case JTAG_PERF:
+        // Here, wValue bit0 resets the counters after reading.
+        perf_snapshot();
+        if (wValue & 1) {
+            perf_reset();
+        }
+        USBFS_currentTD.pData = (volatile uint8 *)&perf_report;
+        USBFS_currentTD.count = MIN(sizeof(perf_report), CY_GET_REG16(USBFS_wLength));
+        requestHandled = USBFS_InitControlRead();
+        break;
     }
     return (requestHandled);
 }
 
+/**************************************
+ * USBFS EP ISR Callbacks
+ *************************************/
+// Serve the channel whose EP pair has the given EP. Every EP the USBFS component can
+// have is hooked, so a channel added to channels[] needs no callbacks of its own.
+static void USBFS_ep_event(uint8 ep) {
+    for (uint8 c = 0; c < CHANNELS; c++) {
+        if (channels[c].in_ep == ep) {
+            USBFS_load_next(&channels[c]);
+        } else if (channels[c].out_ep == ep) {
+            USBFS_receive(&channels[c]);
+        }
+    }
+}
+
+// clang-format off
+void USBFS_EP_1_ISR_ExitCallback() { USBFS_ep_event(1); }
+void USBFS_EP_2_ISR_ExitCallback() { USBFS_ep_event(2); }
+void USBFS_EP_3_ISR_ExitCallback() { USBFS_ep_event(3); }
+void USBFS_EP_4_ISR_ExitCallback() { USBFS_ep_event(4); }
+void USBFS_EP_5_ISR_ExitCallback() { USBFS_ep_event(5); }
+void USBFS_EP_6_ISR_ExitCallback() { USBFS_ep_event(6); }
+void USBFS_EP_7_ISR_ExitCallback() { USBFS_ep_event(7); }
+void USBFS_EP_8_ISR_ExitCallback() { USBFS_ep_event(8); }
+// clang-format on
+
 /**************************************
  * Interrupt handler
  *************************************/
+// VTref and the console are sampled here rather than from the ADC EOC and UART RX
+// interrupts. The ADC converts continuously, and an EOC interrupt would preempt the
+// JTAG/USB path on every conversion, while target power changes at human speed and
+// one sample per tick follows it. The console is typed by hand, and a tick of latency
+// is not noticed. Either way the work is out of the main loop.
 CY_ISR(Slow_Tick_ISR) {
+    uint8 c;
     Timer_1_STATUS;
     count++;
+    /* Sample VTref, and wake check_VTref() only when target power changes.
+       A tick without a new result keeps the last one. */
+    if (ADC_IsEndConversion(ADC_RETURN_STATUS)) {
+        vtref_counts = ADC_GetResult32();
+        if (!vtref_pwr && vtref_counts > vtref_on_counts) {
+            vtref_pwr = 1;
+            vtref_event = 1;
+        } else if (vtref_pwr && vtref_counts < vtref_off_counts) {
+            vtref_pwr = 0;
+            vtref_event = 1;
+        }
+    }
+    /* Queue console commands. Drop them while the queue is full. */
+    while ((c = UART_KitProg_GetChar()) != 0 && (uint8)(console_head - console_tail) < CONSOLE_QUEUE_SIZE) {
+        console_queue[console_head++ & (CONSOLE_QUEUE_SIZE - 1)] = c;
+    }
 }
 
 /* [] END OF FILE */
\ No newline at end of file
@@ -0,0 +1,27 @@
+/*
+  Host build of the adapter firmware: DMA controller API.
+
+  Addresses are full host pointers instead of the lower 16 bits.
+ */
+#if !defined(SIM_CYDMAC_H)
+#define SIM_CYDMAC_H
+
+#include "cytypes.h"
+#include <stdint.h>
+
+#define CY_DMA_NUMBER_OF_TDS (128u)
+#define CY_DMA_INVALID_TD (0xffu)
+#define CY_DMA_END_CHAIN_TD (0xffu)
+#define CY_DMA_DISABLE_TD (0xfeu)
+#define CY_DMA_TD_INC_SRC_ADR (0x08u)
+#define CY_DMA_TD_INC_DST_ADR (0x04u)
+#define CY_DMA_STATUS_CHAIN_ACTIVE (0x01u)
+
+uint8 CyDmaTdAllocate(void);
+cystatus CyDmaTdSetConfiguration(uint8 tdHandle, uint16 transferCount, uint8 nextTd, uint8 configuration);
+cystatus CyDmaTdSetAddress(uint8 tdHandle, uintptr_t source, uintptr_t destination);
+cystatus CyDmaChSetInitialTd(uint8 chHandle, uint8 startTd);
+cystatus CyDmaChEnable(uint8 chHandle, uint8 preserveTds);
+cystatus CyDmaChStatus(uint8 chHandle, uint8 *currentTd, uint8 *state);
+
+#endif
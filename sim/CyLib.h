@@ -0,0 +1,40 @@
+/*
+  Host build of the adapter firmware: CyLib and the Cortex-M3 core registers it uses.
+ */
+#if !defined(SIM_CYLIB_H)
+#define SIM_CYLIB_H
+
+#include "cytypes.h"
+#include "cyfitter.h"
+
+void CyDelay(uint32 milliseconds);
+void CyDelayUs(uint16 microseconds);
+uint8 CyEnterCriticalSection(void);
+void CyExitCriticalSection(uint8 savedIntrStatus);
+
+// DWT CYCCNT counts bus clocks of the modeled TCK, so cycle counts do not depend on the host.
+typedef struct {
+    volatile uint32 CTRL;
+    volatile uint32 CYCCNT;
+} DWT_Type;
+typedef struct {
+    volatile uint32 DEMCR;
+} CoreDebug_Type;
+extern DWT_Type *DWT;
+extern CoreDebug_Type *CoreDebug;
+#define CoreDebug_DEMCR_TRCENA_Msk (1u << 24)
+#define DWT_CTRL_CYCCNTENA_Msk (1u << 0)
+
+static inline uint32 __RBIT(uint32 value) {
+    uint32 r = 0;
+    for (int i = 0; i < 32; i++) {
+        r = (r << 1) | ((value >> i) & 1);
+    }
+    return r;
+}
+
+static inline uint32 __REV(uint32 value) {
+    return (value >> 24) | ((value >> 8) & 0xff00u) | ((value << 8) & 0xff0000u) | (value << 24);
+}
+
+#endif
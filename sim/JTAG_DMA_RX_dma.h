@@ -0,0 +1,11 @@
+/*
+  Host build of the adapter firmware: DMA component JTAG_DMA_RX.
+ */
+#if !defined(SIM_JTAG_DMA_RX_DMA_H)
+#define SIM_JTAG_DMA_RX_DMA_H
+
+#include "cytypes.h"
+
+uint8 JTAG_DMA_RX_DmaInitialize(uint8 BurstCount, uint8 ReqestPerBurst, uint16 UpperSrcAddress, uint16 UpperDestAddress);
+
+#endif
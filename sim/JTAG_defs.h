@@ -0,0 +1,35 @@
+/*
+  Host build of the adapter firmware: registers of the JTAG component.
+
+  Register accesses are routed to the datapath model in hal.c. A byte written to
+  F0 is taken by the model at the next register access, as the UDB takes it at
+  the next clock. The DMA model in hal.c moves bytes to and from the FIFOs at
+  the addresses F0_PTR and F1_PTR.
+ */
+#if !defined(SIM_JTAG_DEFS_H)
+#define SIM_JTAG_DEFS_H
+
+#include "cytypes.h"
+#include <stdint.h>
+
+volatile uint8 *sim_jtag_f0(void);
+uint8 sim_jtag_f1(void);
+volatile uint8 *sim_jtag_ctrl(void);
+uint8 sim_jtag_status(void);
+void sim_jtag_clear(uint8 fifo);
+extern reg8 sim_jtag_f0_ptr, sim_jtag_f1_ptr;
+
+#define JTAG_Datapath_1_F0_REG (*sim_jtag_f0())
+#define JTAG_Datapath_1_F1_REG (sim_jtag_f1())
+#define JTAG_Datapath_1_F0_PTR (&sim_jtag_f0_ptr)
+#define JTAG_Datapath_1_F1_PTR (&sim_jtag_f1_ptr)
+#define JTAG_DMA_ADDR(p) ((uintptr_t)(p))
+#define JTAG_Datapath_1_F0_CLEAR sim_jtag_clear(0)
+#define JTAG_Datapath_1_F1_CLEAR sim_jtag_clear(1)
+#define JTAG_CtrlReg_1_Control (*sim_jtag_ctrl())
+#define JTAG_CtrlReg_1_Write(cmd) (*sim_jtag_ctrl() = (cmd))
+#define JTAG_CtrlReg_1_Read() (*sim_jtag_ctrl())
+#define JTAG_StatusReg_1_Status (sim_jtag_status())
+#define JTAG_StatusReg_1_Read() (sim_jtag_status())
+
+#endif
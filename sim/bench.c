@@ -0,0 +1,151 @@
+/*
+  Benchmark of the command interpreter with OpenOCD-like traffic, in both protocols.
+
+  The figures are per iteration of the traffic and do not depend on the host, so
+  they can be kept as a baseline. Execution speed is measured on the board (the
+  'b' console command), not here. The USB overhead counts the bulk bytes and
+  8 setup bytes per control transfer, beyond the TDI bytes of the shifted bits
+  and the TDO bytes returned.
+ */
+#include "sim.h"
+#include <stdio.h>
+
+#define ITERATIONS (200u)
+#define DR_BYTES (250u)
+
+static const SIM_TAP chain[] = {{.ir_len = 4, .idcode = 0x4ba00477u, .idcode_ir = 0x0e}};
+
+// IDCODE read: IR scan of 4 bits, then DR scan of 32 bits.
+static uint16 gen_idcode(uint8 *buf) {
+    uint16 n = 0;
+    buf[n++] = 0x01 | (11 << 4); // Shift-IR
+    buf[n++] = 0x06 | (((4 - 1) << 1 | 1) << 4);
+    buf[n++] = 0x0e;
+    buf[n++] = 0x01 | (1 << 4); // Run-Test/Idle
+    buf[n++] = 0x01 | (4 << 4); // Shift-DR
+    for (int i = 0; i < 4; i++) {
+        buf[n++] = 0x06 | (((8 - 1) << 1 | (i == 3)) << 4);
+        buf[n++] = 0x00;
+    }
+    buf[n++] = 0x01 | (1 << 4);
+    return n;
+}
+
+// IDCODE with CMD 14.
+static uint16 gen_idcode_fused(uint8 *buf) {
+    uint16 n = 0;
+    buf[n++] = 0x0e | (1 << 4); // IR, capture
+    buf[n++] = 1;               // Run-Test/Idle
+    buf[n++] = 4;
+    buf[n++] = 0;
+    buf[n++] = 0x0e;
+    buf[n++] = 0x0e; // DR, capture
+    buf[n++] = 1;
+    buf[n++] = 32;
+    buf[n++] = 0;
+    for (int i = 0; i < 4; i++) {
+        buf[n++] = 0x00;
+    }
+    return n;
+}
+
+// Flash programming: long DR scan, then idle clocks.
+static uint16 gen_dr_write(uint8 *buf) {
+    uint16 n = 0;
+    buf[n++] = 0x01 | (4 << 4);
+    for (uint16 i = 0; i < DR_BYTES; i++) {
+        buf[n++] = 0x06 | (((8 - 1) << 1 | (i == DR_BYTES - 1)) << 4);
+        buf[n++] = (uint8)i;
+    }
+    buf[n++] = 0x01 | (1 << 4);
+    buf[n++] = 0x07 | (15 << 4);
+    return n;
+}
+
+// Flash programming by CMD 8.
+static uint16 gen_dr_write_long(uint8 *buf) {
+    uint16 n = 0;
+    buf[n++] = 0x01 | (4 << 4);
+    buf[n++] = 0x08 | (1 << 4);
+    buf[n++] = (DR_BYTES * 8) & 0xff;
+    buf[n++] = (DR_BYTES * 8) >> 8;
+    for (uint16 i = 0; i < DR_BYTES; i++) {
+        buf[n++] = (uint8)i;
+    }
+    buf[n++] = 0x01 | (1 << 4);
+    buf[n++] = 0x07 | (15 << 4);
+    return n;
+}
+
+static uint16 gen_dr_write_nocap(uint8 *buf) {
+    uint16 n = gen_dr_write_long(buf);
+    buf[1] |= (4 << 4);
+    return n;
+}
+
+static const struct {
+    const char *name;
+    uint16 (*gen)(uint8 *buf);
+    uint16 resp_len;
+} traffic[] = {
+    {"IDCODE", gen_idcode, 5},
+    {"IDCODE (CMD 14)", gen_idcode_fused, 5},
+    {"DR write", gen_dr_write, DR_BYTES},
+    {"DR write (CMD 8)", gen_dr_write_long, DR_BYTES},
+    {"DR write (CMD 8, no capture)", gen_dr_write_nocap, 0},
+};
+
+// Keep in sync with PERF in main.c.
+#define PERF_WORDS (72u)
+#define PERF_CMD_COUNT (1u)
+#define PERF_BITS (36u)
+static uint32 perf_word(const uint8 *perf, uint16 i) {
+    return perf[i * 4] | (perf[i * 4 + 1] << 8) | (perf[i * 4 + 2] << 16) | ((uint32)perf[i * 4 + 3] << 24);
+}
+
+static void bench(uint16 k, uint16 flags) {
+    static uint8 buf[1024];
+    static uint8 resp[1024];
+    uint8 perf[PERF_WORDS * 4];
+    SIM_USB_STATS usb;
+    SIM_USB_STATS done;
+    uint32 cmds = 0;
+    uint32 bits;
+    uint32 bytes;
+    uint32 tdo_bytes = 0;
+    uint8 status;
+
+    sim_control(JTAG_ENABLE, flags);
+    sim_control_read(JTAG_PERF, 1, perf, sizeof(perf));
+    usb = sim_usb;
+    for (uint16 i = 0; i < ITERATIONS; i++) {
+        uint16 len = traffic[k].gen(buf);
+        if (flags & SESSION_FRAMED) {
+            tdo_bytes += sim_frame(buf, len, resp, sizeof(resp), &status);
+        } else {
+            tdo_bytes += sim_legacy(buf, len, resp, traffic[k].resp_len);
+        }
+    }
+    done = sim_usb;
+    sim_control_read(JTAG_PERF, 1, perf, sizeof(perf));
+    sim_control(JTAG_DISABLE, 0);
+
+    for (uint16 c = 0; c < 16; c++) {
+        cmds += perf_word(perf, PERF_CMD_COUNT + c);
+    }
+    bits = perf_word(perf, PERF_BITS);
+    bytes = (done.out_bytes - usb.out_bytes) + (done.in_bytes - usb.in_bytes) + 8 * (done.control - usb.control);
+    printf("%-30s %-7s %7.1f %8.1f %8.1f %9.3f %7.1f %8.1f\n", traffic[k].name, (flags & SESSION_FRAMED) ? "framed" : "legacy",
+           (double)cmds / ITERATIONS, (double)bits / ITERATIONS, (double)bytes / ITERATIONS, (bytes - bits / 8.0 - tdo_bytes) / bits,
+           (double)(done.control - usb.control) / ITERATIONS, (double)(done.out_packets - usb.out_packets + done.in_packets - usb.in_packets) / ITERATIONS);
+}
+
+int main(void) {
+    sim_start(chain, 1);
+    printf("%-30s %-7s %7s %8s %8s %9s %7s %8s\n", "traffic", "", "cmds/it", "bits/it", "USB B/it", "ovh B/bit", "ctrl/it", "pkts/it");
+    for (uint16 k = 0; k < sizeof(traffic) / sizeof(traffic[0]); k++) {
+        bench(k, 0);
+        bench(k, SESSION_FRAMED);
+    }
+    return 0;
+}
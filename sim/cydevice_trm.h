@@ -0,0 +1,10 @@
+/*
+  Host build of the adapter firmware: base addresses of the device.
+ */
+#if !defined(SIM_CYDEVICE_TRM_H)
+#define SIM_CYDEVICE_TRM_H
+
+#define CYDEV_SRAM_BASE (0x1fff8000u)
+#define CYDEV_PERIPH_BASE (0x40000000u)
+
+#endif
@@ -0,0 +1,15 @@
+/*
+  Host build of the adapter firmware: placement of the components.
+
+  The DMA channels of the JTAG component are placed, so the long shifts go
+  through the DMA model in hal.c.
+ */
+#if !defined(SIM_CYFITTER_H)
+#define SIM_CYFITTER_H
+
+#include "cydevice_trm.h"
+
+#define JTAG_DMA_TX__DRQ_NUMBER (0u)
+#define JTAG_DMA_RX__DRQ_NUMBER (1u)
+
+#endif
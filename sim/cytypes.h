@@ -0,0 +1,36 @@
+/*
+  Host build of the adapter firmware: PSoC types and macros.
+ */
+#if !defined(SIM_CYTYPES_H)
+#define SIM_CYTYPES_H
+
+#include <stdint.h>
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int8_t int8;
+typedef int16_t int16;
+typedef int32_t int32;
+typedef volatile uint8 reg8;
+typedef volatile uint16 reg16;
+typedef volatile uint32 reg32;
+typedef uint32 cystatus;
+
+#define CYRET_SUCCESS (0x00u)
+#define CYRET_BAD_PARAM (0x01u)
+#define LO16(x) ((uint16)(x))
+#define HI16(x) ((uint16)((uint32)(x) >> 16))
+
+#define CY_ISR(name) void name(void)
+#define CY_ISR_PROTO(name) void name(void)
+#define CyGlobalIntEnable
+#define CyGlobalIntDisable
+
+#define CY_GET_REG8(addr) (*(reg8 *)(addr))
+#define CY_GET_REG16(addr) (*(reg16 *)(addr))
+#define CY_SET_REG8(addr, value) (*(reg8 *)(addr) = (uint8)(value))
+
+#define BCLK__BUS_CLK__HZ (76000000u)
+
+#endif
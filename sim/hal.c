@@ -0,0 +1,415 @@
+/*
+  Host build of the adapter firmware: PSoC components.
+
+  The JTAG component datapath is modeled at the register level (F0/F1 FIFOs,
+  control and status registers), and shifts through the target model. The DMA
+  channels of the JTAG component move bytes between RAM and the FIFOs on their
+  requests. The USB endpoints are driven by the host side in host.c.
+ */
+#include <project.h>
+#include <CyDmac.h>
+#include <JTAG_DMA_RX_dma.h>
+#include <JTAG_DMA_TX_dma.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "hal.h"
+#include "sim.h"
+
+/**************************************
+ * CPU
+ *************************************/
+static DWT_Type dwt;
+static CoreDebug_Type core_debug;
+DWT_Type *DWT = &dwt;
+CoreDebug_Type *CoreDebug = &core_debug;
+
+void CyDelay(uint32 milliseconds) {
+    (void)milliseconds;
+    sim_jtag_status(); /* Let the datapath see the control register, e.g. TRST. */
+}
+
+void CyDelayUs(uint16 microseconds) {
+    (void)microseconds;
+}
+
+uint8 CyEnterCriticalSection(void) {
+    return 0;
+}
+
+void CyExitCriticalSection(uint8 savedIntrStatus) {
+    (void)savedIntrStatus;
+}
+
+/**************************************
+ * JTAG component datapath
+ *************************************/
+// Cmd register: bit0-3 = bit count, bit4 = TMS mode, bit5 = TMS high on the last bit
+// in TDI mode, bit7 = TRST. Each F0 byte is shifted MSB first, and TDO is shifted
+// into the LSB of the F1 byte. F0 and F1 are 4 bytes deep.
+#define DP_FIFO_DEPTH (4u)
+#define DP_CMD_TMS (1u << 4)
+#define DP_CMD_LAST_TMS (1u << 5)
+#define DP_CMD_TRST (1u << 7)
+#define DP_STAT_DONE (1u << 1)
+static volatile uint8 jtag_ctrl;
+static volatile uint8 f0_slot; // written by the firmware after sim_jtag_f0() returns
+static uint8 f0_written;
+static uint8 f0[DP_FIFO_DEPTH], f0_head, f0_count;
+static uint8 f1[DP_FIFO_DEPTH], f1_head, f1_count;
+reg8 sim_jtag_f0_ptr, sim_jtag_f1_ptr; // DMA addresses of F0 and F1
+
+static uint8 dma_run(void);
+
+static uint8 shift_byte(uint8 out) {
+    uint8 count = jtag_ctrl & 0x0f;
+    uint8 in = 0;
+    uint8 bit;
+    for (uint8 j = 0; j < count; j++) {
+        bit = (out >> (7 - j)) & 1;
+        if (jtag_ctrl & DP_CMD_TMS) {
+            in = (in << 1) | sim_target_clock(bit, 0);
+        } else {
+            in = (in << 1) | sim_target_clock((jtag_ctrl & DP_CMD_LAST_TMS) && j == count - 1, bit);
+        }
+        DWT->CYCCNT += sim_tck_div;
+    }
+    return in;
+}
+
+// Take the byte written to F0, and shift F0 bytes while F1 has room.
+static void datapath_run(void) {
+    if (f0_written) {
+        f0_written = 0;
+        if (f0_count == DP_FIFO_DEPTH) {
+            sim_fail("JTAG: F0 overflow");
+        }
+        f0[(f0_head + f0_count++) % DP_FIFO_DEPTH] = f0_slot;
+    }
+    if (jtag_ctrl & DP_CMD_TRST) {
+        sim_target_trst();
+    }
+    do {
+        while (f0_count > 0 && f1_count < DP_FIFO_DEPTH) {
+            f1[(f1_head + f1_count++) % DP_FIFO_DEPTH] = shift_byte(f0[f0_head]);
+            f0_head = (f0_head + 1) % DP_FIFO_DEPTH;
+            f0_count--;
+        }
+    } while (dma_run());
+}
+
+volatile uint8 *sim_jtag_f0(void) {
+    datapath_run();
+    f0_written = 1;
+    return &f0_slot;
+}
+
+uint8 sim_jtag_f1(void) {
+    uint8 b;
+    datapath_run();
+    if (f1_count == 0) {
+        sim_fail("JTAG: F1 read while empty");
+    }
+    b = f1[f1_head];
+    f1_head = (f1_head + 1) % DP_FIFO_DEPTH;
+    f1_count--;
+    return b;
+}
+
+volatile uint8 *sim_jtag_ctrl(void) {
+    datapath_run();
+    return &jtag_ctrl;
+}
+
+uint8 sim_jtag_status(void) {
+    datapath_run();
+    return (f1_count > 0) ? DP_STAT_DONE : 0;
+}
+
+void sim_jtag_clear(uint8 fifo) {
+    datapath_run();
+    if (fifo == 0) {
+        f0_count = 0;
+    } else {
+        f1_count = 0;
+    }
+}
+
+/**************************************
+ * DMA
+ *************************************/
+// Channel = DRQ number. DMA_TX is requested while F0 is not full, and DMA_RX while
+// F1 is not empty. A request moves one byte of the current TD; at the end of the TD
+// the channel goes on with the next TD, or stops at CY_DMA_DISABLE_TD / END_CHAIN_TD.
+#define DMA_CHANNELS (2u)
+typedef struct {
+    uint16 count;
+    uint8 next;
+    uint8 config;
+    uintptr_t src;
+    uintptr_t dst;
+} DMA_TD;
+typedef struct {
+    uint8 initial_td;
+    uint8 td;
+    uint8 active;
+    uint16 done; // bytes of the current TD
+} DMA_CH;
+static DMA_TD dma_td[CY_DMA_NUMBER_OF_TDS];
+static uint8 dma_tds;
+static DMA_CH dma_ch[DMA_CHANNELS];
+uint32 sim_dma_bytes = 0;
+
+uint8 JTAG_DMA_TX_DmaInitialize(uint8 BurstCount, uint8 ReqestPerBurst, uint16 UpperSrcAddress, uint16 UpperDestAddress) {
+    (void)BurstCount, (void)ReqestPerBurst, (void)UpperSrcAddress, (void)UpperDestAddress;
+    return JTAG_DMA_TX__DRQ_NUMBER;
+}
+
+uint8 JTAG_DMA_RX_DmaInitialize(uint8 BurstCount, uint8 ReqestPerBurst, uint16 UpperSrcAddress, uint16 UpperDestAddress) {
+    (void)BurstCount, (void)ReqestPerBurst, (void)UpperSrcAddress, (void)UpperDestAddress;
+    return JTAG_DMA_RX__DRQ_NUMBER;
+}
+
+uint8 CyDmaTdAllocate(void) {
+    return (dma_tds < CY_DMA_NUMBER_OF_TDS) ? dma_tds++ : CY_DMA_INVALID_TD;
+}
+
+cystatus CyDmaTdSetConfiguration(uint8 tdHandle, uint16 transferCount, uint8 nextTd, uint8 configuration) {
+    if (tdHandle >= dma_tds) {
+        return CYRET_BAD_PARAM;
+    }
+    dma_td[tdHandle].count = transferCount;
+    dma_td[tdHandle].next = nextTd;
+    dma_td[tdHandle].config = configuration;
+    return CYRET_SUCCESS;
+}
+
+cystatus CyDmaTdSetAddress(uint8 tdHandle, uintptr_t source, uintptr_t destination) {
+    if (tdHandle >= dma_tds) {
+        return CYRET_BAD_PARAM;
+    }
+    dma_td[tdHandle].src = source;
+    dma_td[tdHandle].dst = destination;
+    return CYRET_SUCCESS;
+}
+
+cystatus CyDmaChSetInitialTd(uint8 chHandle, uint8 startTd) {
+    if (chHandle >= DMA_CHANNELS || startTd >= dma_tds) {
+        return CYRET_BAD_PARAM;
+    }
+    dma_ch[chHandle].initial_td = startTd;
+    return CYRET_SUCCESS;
+}
+
+cystatus CyDmaChEnable(uint8 chHandle, uint8 preserveTds) {
+    (void)preserveTds;
+    if (chHandle >= DMA_CHANNELS) {
+        return CYRET_BAD_PARAM;
+    }
+    dma_ch[chHandle].td = dma_ch[chHandle].initial_td;
+    dma_ch[chHandle].done = 0;
+    dma_ch[chHandle].active = 1;
+    datapath_run();
+    return CYRET_SUCCESS;
+}
+
+cystatus CyDmaChStatus(uint8 chHandle, uint8 *currentTd, uint8 *state) {
+    if (chHandle >= DMA_CHANNELS) {
+        return CYRET_BAD_PARAM;
+    }
+    datapath_run();
+    if (currentTd != NULL) {
+        *currentTd = dma_ch[chHandle].td;
+    }
+    if (state != NULL) {
+        *state = dma_ch[chHandle].active ? CY_DMA_STATUS_CHAIN_ACTIVE : 0;
+    }
+    return CYRET_SUCCESS;
+}
+
+// Read a byte for a TD: F1 is popped, anything else is RAM.
+static uint8 dma_read(uintptr_t addr) {
+    uint8 b;
+    if (addr == (uintptr_t)&sim_jtag_f0_ptr) {
+        sim_fail("DMA: read from F0");
+    }
+    if (addr != (uintptr_t)&sim_jtag_f1_ptr) {
+        return *(const uint8 *)addr;
+    }
+    b = f1[f1_head];
+    f1_head = (f1_head + 1) % DP_FIFO_DEPTH;
+    f1_count--;
+    return b;
+}
+
+// Write a byte for a TD: F0 is pushed, anything else is RAM.
+static void dma_write(uintptr_t addr, uint8 b) {
+    if (addr == (uintptr_t)&sim_jtag_f1_ptr) {
+        sim_fail("DMA: write to F1");
+    }
+    if (addr != (uintptr_t)&sim_jtag_f0_ptr) {
+        *(uint8 *)addr = b;
+        return;
+    }
+    f0[(f0_head + f0_count++) % DP_FIFO_DEPTH] = b;
+}
+
+// Serve the pending requests, one byte per channel. Returns the bytes moved.
+static uint8 dma_run(void) {
+    uint8 moved = 0;
+    uint8 request;
+    DMA_CH *ch;
+    DMA_TD *td;
+
+    for (uint8 k = 0; k < DMA_CHANNELS; k++) {
+        ch = &dma_ch[k];
+        request = (k == JTAG_DMA_TX__DRQ_NUMBER) ? f0_count < DP_FIFO_DEPTH : f1_count > 0;
+        if (!ch->active || !request) {
+            continue;
+        }
+        td = &dma_td[ch->td];
+        if (td->count > 0) {
+            dma_write(td->dst + ((td->config & CY_DMA_TD_INC_DST_ADR) ? ch->done : 0),
+                      dma_read(td->src + ((td->config & CY_DMA_TD_INC_SRC_ADR) ? ch->done : 0)));
+            ch->done++;
+            moved++;
+            sim_dma_bytes++;
+        }
+        if (ch->done == td->count) {
+            ch->done = 0;
+            if (td->next == CY_DMA_DISABLE_TD || td->next == CY_DMA_END_CHAIN_TD) {
+                ch->active = 0;
+            } else {
+                ch->td = td->next;
+            }
+        }
+    }
+    return moved;
+}
+
+/**************************************
+ * Clocks, timer and interrupt
+ *************************************/
+static uint16 pwm_div = 1000;
+reg8 sim_timer_status;
+static void (*tick_isr)(void);
+
+void CLK_JTAG_SetDividerValue(uint16 clkDivider) {
+    sim_tck_div = clkDivider;
+}
+
+uint16 CLK_JTAG_GetDividerRegister(void) {
+    return sim_tck_div - 1;
+}
+
+void CLK_PWM_SetDivider(uint16 clkDivider) {
+    pwm_div = clkDivider;
+}
+
+uint16 CLK_PWM_GetDividerRegister(void) {
+    return pwm_div;
+}
+
+void Timer_1_Start(void) {
+}
+
+uint16 Timer_1_ReadCounter(void) {
+    return (uint16)DWT->CYCCNT;
+}
+
+void isr_1_StartEx(void (*address)(void)) {
+    tick_isr = address;
+}
+
+void hal_tick(void) {
+    if (tick_isr != NULL) {
+        tick_isr();
+    }
+}
+
+/**************************************
+ * ADC and target power
+ *************************************/
+// 1 count is 1mV.
+int32 hal_vtref_mv = 3300;
+
+void ADC_Start(void) {
+}
+
+void ADC_StartConvert(void) {
+}
+
+uint8 ADC_IsEndConversion(uint8 retMode) {
+    (void)retMode;
+    return 1;
+}
+
+int32 ADC_GetResult32(void) {
+    return hal_vtref_mv;
+}
+
+float ADC_CountsTo_Volts(int32 adcCounts) {
+    return adcCounts / 1000.0f;
+}
+
+int16 ADC_CountsTo_mVolts(int32 adcCounts) {
+    return (int16)adcCounts;
+}
+
+void AMux_Start(void) {
+}
+
+void AMux_Select(uint8 chan) {
+    (void)chan;
+}
+
+void VDAC_3v3_Start(void) {
+}
+
+void VDAC_3v3_Stop(void) {
+}
+
+/**************************************
+ * UART and LED
+ *************************************/
+// Text goes to stdout if SIM_VERBOSE is set. Trace records are dropped.
+#define CONSOLE_SIZE (64u)
+static uint8 console[CONSOLE_SIZE];
+static uint8 console_head, console_tail;
+
+void hal_console_put(uint8 c) {
+    if ((uint8)(console_head - console_tail) < CONSOLE_SIZE) {
+        console[console_head++ % CONSOLE_SIZE] = c;
+    }
+}
+
+void UART_KitProg_Start(void) {
+}
+
+uint8 UART_KitProg_GetChar(void) {
+    return (console_tail != console_head) ? console[console_tail++ % CONSOLE_SIZE] : 0;
+}
+
+void UART_KitProg_PutChar(uint8 txDataByte) {
+    (void)txDataByte;
+}
+
+void UART_KitProg_PutString(const char string[]) {
+    if (getenv("SIM_VERBOSE") != NULL) {
+        fputs(string, stdout);
+    }
+}
+
+void UART_KitProg_WriteTxData(uint8 txDataByte) {
+    (void)txDataByte;
+}
+
+uint8 UART_KitProg_ReadTxStatus(void) {
+    return UART_KitProg_TX_STS_FIFO_NOT_FULL;
+}
+
+void PWM_LED_Start(void) {
+}
+
+void PWM_LED_WriteCompare(uint8 compare) {
+    (void)compare;
+}
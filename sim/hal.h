@@ -0,0 +1,13 @@
+/*
+  Host build of the adapter firmware: hooks from the host side into the components.
+ */
+#if !defined(SIM_HAL_H)
+#define SIM_HAL_H
+
+#include "cytypes.h"
+
+extern int32 hal_vtref_mv;    // VTref sampled by the ADC
+void hal_tick(void);          // run the Timer_1 ISR
+void hal_console_put(uint8 c); // receive a character from the KitProg's COM port
+
+#endif
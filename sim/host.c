@@ -0,0 +1,353 @@
+/*
+  Host build of the adapter firmware: USBFS endpoints and the USB host.
+
+  The firmware runs its main loop until the host is waiting for nothing more.
+  Each main loop iteration is a host step, in which an IN packet is taken, an
+  OUT packet is given, and Timer_1 ticks every few steps. The firmware waiting
+  for the host elsewhere polls the configuration, which is a host step as well.
+  The main loop is left at its top by reporting a configuration change to the
+  unconfigured state.
+ */
+#include <project.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hal.h"
+#include "sim.h"
+
+int firmware_main(void);
+void loop(void);
+
+#define HOST_BUF_SIZE (1u << 16)
+#define TICK_STEPS (16u)      // main loop iterations per Timer_1 tick
+#define IDLE_STEPS (64u)      // the firmware is idle after this many steps without progress
+#define TIMEOUT_STEPS (10000u) // no IN transfer after this many steps without progress
+#define IN_TRANSFERS (64u)     // IN transfers received and not taken by sim_in() yet
+
+SIM_USB_STATS sim_usb;
+uint16 sim_frame_chunks;
+reg16 sim_usb_wValue, sim_usb_wIndex, sim_usb_wLength;
+reg8 sim_usb_bRequest;
+T_USBFS_TD USBFS_currentTD;
+
+static uint8 out_queue[HOST_BUF_SIZE]; // bulk OUT data not sent yet
+static uint32 out_head, out_tail;
+static uint8 out_ep[SIM_EP_SIZE];
+static uint16 out_ep_len;
+static uint8 out_ep_full;
+static uint8 in_ep[SIM_EP_SIZE];
+static uint16 in_ep_len;
+static uint8 in_ep_full;
+static uint8 in_buf[HOST_BUF_SIZE]; // IN transfers received
+static uint32 in_len;
+static uint32 in_ends[IN_TRANSFERS]; // end of each whole transfer in in_buf
+static uint8 in_count;
+static uint8 *control_buf;    // data stage of a control read
+static uint16 control_len;
+static uint8 read_pending;    // JTAG_READ is sent when the OUT data is taken
+static uint16 read_pending_len;
+
+typedef enum { RUN_IDLE, RUN_IN } RUN_MODE;
+static RUN_MODE run_mode;
+static uint8 pausing; // 1: leave loop(), 2: loop() is left
+static uint32 idle_steps;
+static uint32 steps;
+static uint32 last_tck;
+static jmp_buf start_jmp;
+
+void sim_fail(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fputs("FAIL: ", stderr);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(1);
+}
+
+/**************************************
+ * USBFS
+ *************************************/
+static void control(uint8 request, uint16 value, uint16 length);
+
+static void host_step(void) {
+    uint8 progress = sim_tck_clocks != last_tck;
+    uint16 n;
+
+    last_tck = sim_tck_clocks;
+    if (in_ep_full) {
+        if (in_len + in_ep_len > HOST_BUF_SIZE || in_count == IN_TRANSFERS) {
+            sim_fail("IN transfers too long");
+        }
+        memcpy(in_buf + in_len, in_ep, in_ep_len);
+        in_len += in_ep_len;
+        if (in_ep_len < SIM_EP_SIZE) {
+            in_ends[in_count++] = in_len;
+        }
+        in_ep_full = 0;
+        sim_usb.in_packets++;
+        sim_usb.in_bytes += in_ep_len;
+        progress = 1;
+        USBFS_EP_1_ISR_ExitCallback();
+    }
+    if (!out_ep_full && out_tail != out_head) {
+        n = (out_head - out_tail < SIM_EP_SIZE) ? out_head - out_tail : SIM_EP_SIZE;
+        for (out_ep_len = 0; out_ep_len < n; out_ep_len++) {
+            out_ep[out_ep_len] = out_queue[out_tail++ % HOST_BUF_SIZE];
+        }
+        out_ep_full = 1;
+        sim_usb.out_packets++;
+        sim_usb.out_bytes += n;
+        progress = 1;
+        USBFS_EP_2_ISR_ExitCallback();
+    }
+    if (read_pending && out_tail == out_head) { /* The last packet is taken by OUT EP. */
+        read_pending = 0;
+        control(JTAG_READ, read_pending_len, 0);
+        progress = 1;
+    }
+    if (++steps % TICK_STEPS == 0) {
+        hal_tick();
+    }
+    idle_steps = progress ? 0 : idle_steps + 1;
+}
+
+void USBFS_Start(uint8 device, uint8 mode) {
+    (void)device;
+    (void)mode;
+}
+
+uint8 USBFS_GetConfiguration(void) {
+    if (pausing == 1) {
+        pausing = 2;
+        return 0;
+    }
+    if (pausing == 2) {
+        longjmp(start_jmp, 1); /* Back from the enumeration loop of main() to sim_start(). */
+    }
+    host_step(); /* The firmware waits for the host, e.g. in USBFS_make_room(). */
+    return 1;
+}
+
+// Called at the top of the main loop, where the firmware may be paused.
+uint8 USBFS_IsConfigurationChanged(void) {
+    host_step();
+    if ((run_mode == RUN_IN) ? (in_count > 0 || idle_steps > TIMEOUT_STEPS) : (idle_steps > IDLE_STEPS)) {
+        pausing = 1;
+    }
+    return pausing != 0;
+}
+
+void USBFS_EnableOutEP(uint8 epNumber) {
+    (void)epNumber;
+    out_ep_full = 0;
+}
+
+uint8 USBFS_GetEPState(uint8 epNumber) {
+    if (epNumber == 1) {
+        return in_ep_full ? USBFS_IN_BUFFER_FULL : USBFS_IN_BUFFER_EMPTY;
+    }
+    return out_ep_full ? USBFS_OUT_BUFFER_FULL : USBFS_OUT_BUFFER_EMPTY;
+}
+
+uint16 USBFS_GetEPCount(uint8 epNumber) {
+    (void)epNumber;
+    return out_ep_len;
+}
+
+uint16 USBFS_ReadOutEP(uint8 epNumber, uint8 *pData, uint16 length) {
+    (void)epNumber;
+    length = (length < out_ep_len) ? length : out_ep_len;
+    memcpy(pData, out_ep, length);
+    return length;
+}
+
+void USBFS_LoadInEP(uint8 epNumber, const uint8 *pData, uint16 length) {
+    (void)epNumber;
+    if (in_ep_full || length > SIM_EP_SIZE) {
+        sim_fail("IN EP loaded while full, or with %u bytes", length);
+    }
+    memcpy(in_ep, pData, length);
+    in_ep_len = length;
+    in_ep_full = 1;
+}
+
+uint8 USBFS_InitNoDataControlTransfer(void) {
+    return USBFS_TRUE;
+}
+
+uint8 USBFS_InitControlRead(void) {
+    control_len = (USBFS_currentTD.count < control_len) ? USBFS_currentTD.count : control_len;
+    memcpy(control_buf, (const uint8 *)USBFS_currentTD.pData, control_len);
+    return USBFS_TRUE;
+}
+
+/**************************************
+ * USB host
+ *************************************/
+static void run(RUN_MODE mode) {
+    run_mode = mode;
+    idle_steps = 0;
+    pausing = 0;
+    loop();
+    pausing = 0;
+}
+
+void sim_start(const SIM_TAP *taps, uint8 count) {
+    sim_target_init(taps, count);
+    memset(&sim_usb, 0, sizeof(sim_usb));
+    out_head = out_tail = 0;
+    out_ep_full = 0;
+    in_ep_full = 0;
+    in_len = 0;
+    in_count = 0;
+    read_pending = 0;
+    run_mode = RUN_IDLE;
+    idle_steps = 0;
+    pausing = 0;
+    if (setjmp(start_jmp) == 0) {
+        firmware_main();
+    }
+    pausing = 0;
+}
+
+static void control(uint8 request, uint16 value, uint16 length) {
+    sim_usb_bRequest = request;
+    sim_usb_wValue = value;
+    sim_usb_wIndex = 0;
+    sim_usb_wLength = length;
+    sim_usb.control++;
+    if (!USBFS_HandleVendorRqst_Callback()) {
+        sim_fail("vendor request 0x%02x stalled", request);
+    }
+}
+
+void sim_control(uint8 request, uint16 value) {
+    control(request, value, 0);
+}
+
+uint16 sim_control_read(uint8 request, uint16 value, uint8 *buf, uint16 len) {
+    control_buf = buf;
+    control_len = len;
+    control(request, value, len);
+    return control_len;
+}
+
+void sim_out(const uint8 *buf, uint16 len) {
+    if (out_head - out_tail + len > HOST_BUF_SIZE) {
+        sim_fail("OUT queue full");
+    }
+    for (uint16 k = 0; k < len; k++) {
+        out_queue[out_head++ % HOST_BUF_SIZE] = buf[k];
+    }
+}
+
+uint32 sim_in(uint8 *buf, uint32 max) {
+    uint32 len;
+    if (in_count == 0) {
+        run(RUN_IN);
+    }
+    if (in_count == 0) {
+        sim_fail("no IN transfer (%lu bytes received)", (unsigned long)in_len);
+    }
+    len = in_ends[0];
+    memcpy(buf, in_buf, (len < max) ? len : max);
+    in_len -= len;
+    memmove(in_buf, in_buf + len, in_len);
+    in_count--;
+    for (uint8 k = 0; k < in_count; k++) {
+        in_ends[k] = in_ends[k + 1] - len;
+    }
+    return len;
+}
+
+void sim_idle(void) {
+    run(RUN_IDLE);
+}
+
+void sim_console(uint8 c) {
+    hal_console_put(c);
+}
+
+uint16 sim_legacy(const uint8 *cmds, uint16 len, uint8 *resp, uint16 resp_len) {
+    sim_control(JTAG_WRITE, len);
+    sim_out(cmds, len);
+    if (resp_len == 0) {
+        sim_idle();
+        return 0;
+    }
+    sim_control(JTAG_READ, resp_len);
+    return sim_in(resp, resp_len);
+}
+
+uint16 sim_legacy_openocd(const uint8 *cmds, uint16 len, uint8 *resp, uint16 resp_len) {
+    sim_control(JTAG_WRITE, len);
+    sim_out(cmds, len);
+    read_pending = 1;
+    read_pending_len = resp_len;
+    return sim_in(resp, resp_len);
+}
+
+// Decode a run-length encoded chunk into out[pos..max), as tools/rle.py does.
+// Bytes beyond max are counted but not stored. Return the decoded length.
+static uint32 rle_decode(const uint8 *in, uint16 len, uint8 *out, uint32 pos, uint32 max) {
+    uint32 start = pos;
+    uint16 i = 0;
+    uint16 n;
+    while (i < len) {
+        if (in[i] & 0x80) {
+            CHECK(i + 1 < len);
+            for (n = (in[i] & 0x7f) + 3; n > 0; n--, pos++) {
+                if (pos < max) {
+                    out[pos] = in[i + 1];
+                }
+            }
+            i += 2;
+        } else {
+            n = in[i] + 1;
+            CHECK(i + 1 + n <= len);
+            for (uint16 k = 0; k < n; k++, pos++) {
+                if (pos < max) {
+                    out[pos] = in[i + 1 + k];
+                }
+            }
+            i += 1 + n;
+        }
+    }
+    return pos - start;
+}
+
+uint32 sim_frame(const uint8 *cmds, uint16 len, uint8 *resp, uint32 max, uint8 *status) {
+    static uint8 seq = 0;
+    static uint8 buf[HOST_BUF_SIZE];
+    uint8 hdr[FRAME_HDR_SIZE] = {len & 0xff, len >> 8, ++seq, 0};
+    uint32 n;
+    uint32 tdo_len = 0;
+    uint16 chunk_len;
+
+    sim_out(hdr, FRAME_HDR_SIZE);
+    sim_out(cmds, len);
+    *status = 0;
+    sim_frame_chunks = 0;
+    do {
+        n = sim_in(buf, sizeof(buf));
+        CHECK(n >= FRAME_HDR_SIZE);
+        chunk_len = buf[0] | (buf[1] << 8);
+        CHECK(buf[2] == seq);
+        CHECK(n == FRAME_HDR_SIZE + chunk_len);
+        if (buf[3] & FRAME_STAT_RLE) {
+            tdo_len += rle_decode(buf + FRAME_HDR_SIZE, chunk_len, resp, tdo_len, max);
+        } else {
+            if (tdo_len < max) {
+                memcpy(resp + tdo_len, buf + FRAME_HDR_SIZE, (max - tdo_len < chunk_len) ? max - tdo_len : chunk_len);
+            }
+            tdo_len += chunk_len;
+        }
+        *status |= buf[3];
+        sim_frame_chunks++;
+    } while (buf[3] & FRAME_STAT_MORE);
+    *status &= ~FRAME_STAT_MORE;
+    return tdo_len;
+}
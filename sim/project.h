@@ -0,0 +1,81 @@
+/*
+  Host build of the adapter firmware: APIs of the components placed in TopDesign.
+  They are implemented by hal.c.
+ */
+#if !defined(SIM_PROJECT_H)
+#define SIM_PROJECT_H
+
+#include "cytypes.h"
+#include "CyLib.h"
+#include "cyapicallbacks.h"
+#include "JTAG.h"
+
+// USBFS
+#define USBFS_5V_OPERATION (2u)
+#define USBFS_FALSE (0u)
+#define USBFS_TRUE (1u)
+#define USBFS_NO_EVENT_PENDING (0u)
+#define USBFS_EVENT_PENDING (1u)
+#define USBFS_OUT_BUFFER_FULL (USBFS_EVENT_PENDING)
+#define USBFS_OUT_BUFFER_EMPTY (USBFS_NO_EVENT_PENDING)
+#define USBFS_IN_BUFFER_FULL (USBFS_NO_EVENT_PENDING)
+#define USBFS_IN_BUFFER_EMPTY (USBFS_EVENT_PENDING)
+extern reg16 sim_usb_wValue, sim_usb_wIndex, sim_usb_wLength;
+extern reg8 sim_usb_bRequest;
+#define USBFS_wValue (&sim_usb_wValue)
+#define USBFS_wIndex (&sim_usb_wIndex)
+#define USBFS_wLength (&sim_usb_wLength)
+#define USBFS_bRequest (&sim_usb_bRequest)
+typedef struct {
+    uint16 count;
+    volatile uint8 *pData;
+    void *pStatusBlock;
+} T_USBFS_TD;
+extern T_USBFS_TD USBFS_currentTD;
+void USBFS_Start(uint8 device, uint8 mode);
+uint8 USBFS_GetConfiguration(void);
+uint8 USBFS_IsConfigurationChanged(void);
+void USBFS_EnableOutEP(uint8 epNumber);
+uint8 USBFS_GetEPState(uint8 epNumber);
+uint16 USBFS_GetEPCount(uint8 epNumber);
+uint16 USBFS_ReadOutEP(uint8 epNumber, uint8 *pData, uint16 length);
+void USBFS_LoadInEP(uint8 epNumber, const uint8 *pData, uint16 length);
+uint8 USBFS_InitNoDataControlTransfer(void);
+uint8 USBFS_InitControlRead(void);
+
+// Clocks, timer and interrupt
+void CLK_JTAG_SetDividerValue(uint16 clkDivider);
+uint16 CLK_JTAG_GetDividerRegister(void);
+void CLK_PWM_SetDivider(uint16 clkDivider);
+uint16 CLK_PWM_GetDividerRegister(void);
+void Timer_1_Start(void);
+uint16 Timer_1_ReadCounter(void);
+extern reg8 sim_timer_status;
+#define Timer_1_STATUS (sim_timer_status)
+void isr_1_StartEx(void (*address)(void));
+
+// ADC and target power
+void ADC_Start(void);
+void ADC_StartConvert(void);
+#define ADC_RETURN_STATUS (1u)
+uint8 ADC_IsEndConversion(uint8 retMode);
+int32 ADC_GetResult32(void);
+float ADC_CountsTo_Volts(int32 adcCounts);
+int16 ADC_CountsTo_mVolts(int32 adcCounts);
+void AMux_Start(void);
+void AMux_Select(uint8 chan);
+void VDAC_3v3_Start(void);
+void VDAC_3v3_Stop(void);
+
+// UART of the KitProg and the status LED
+#define UART_KitProg_TX_STS_FIFO_NOT_FULL (1u << 3)
+void UART_KitProg_Start(void);
+uint8 UART_KitProg_GetChar(void);
+void UART_KitProg_PutChar(uint8 txDataByte);
+void UART_KitProg_PutString(const char string[]);
+void UART_KitProg_WriteTxData(uint8 txDataByte);
+uint8 UART_KitProg_ReadTxStatus(void);
+void PWM_LED_Start(void);
+void PWM_LED_WriteCompare(uint8 compare);
+
+#endif
@@ -0,0 +1,99 @@
+/*
+  Host build of the adapter firmware: the target model and the USB host side,
+  used by the tests and the benchmark.
+ */
+#if !defined(SIM_H)
+#define SIM_H
+
+#include "cytypes.h"
+
+/**************************************
+ * Target
+ *************************************/
+// TAPs of the chain, from TDI to TDO. All of them share TCK and TMS.
+#define SIM_MAX_TAPS (8u)
+#define SIM_DR_BITS (8192u) // longest data register
+typedef struct {
+    uint8 ir_len;
+    uint32 idcode;     // selected at reset, or BYPASS if 0
+    uint8 idcode_ir;   // IDCODE instruction
+    uint8 user_ir;     // instruction of a data register which captures what was updated last
+    uint16 user_bits;  // its length (0 = none)
+    uint8 dap;         // ARM JTAG-DP with a MEM-AP (ir_len 4)
+} SIM_TAP;
+
+// ARM JTAG-DP. Captures answer WAIT at random, and the updates of those scans are ignored.
+#define SIM_DAP_IR_DPACC (0x0a)
+#define SIM_DAP_IR_APACC (0x0b)
+#define SIM_DAP_IR_IDCODE (0x0e)
+#define SIM_MEM_WORDS (4096u) // memory behind the MEM-AP, mirrored over the address space
+extern uint8 sim_dap_wait_percent;
+extern uint32 sim_dap_waits;
+extern uint32 sim_dap_mem[SIM_MEM_WORDS];
+
+// TCK. Below sim_tck_limit, each TDO bit is flipped with probability (limit - div) / limit.
+extern uint16 sim_tck_div;
+extern uint16 sim_tck_limit;
+extern uint32 sim_tck_clocks;
+
+// Bytes moved by the DMA channels of the JTAG component, both directions.
+extern uint32 sim_dma_bytes;
+
+void sim_target_init(const SIM_TAP *taps, uint8 count);
+void sim_target_trst(void);
+uint8 sim_target_clock(uint8 tms, uint8 tdi);
+uint8 sim_target_state(void);
+uint8 sim_target_user_bit(uint8 tap, uint16 bit);
+uint32 sim_random(void);
+void sim_seed(uint32 seed);
+
+/**************************************
+ * USB host
+ *************************************/
+#define SIM_EP_SIZE (64u)
+#define JTAG_ENABLE (0xD0)
+#define JTAG_DISABLE (0xD1)
+#define JTAG_READ (0xD2)
+#define JTAG_WRITE (0xD3)
+#define JTAG_PERF (0xD4)
+#define SESSION_FRAMED (1u << 0)
+#define SESSION_RLE (1u << 1)
+#define FRAME_HDR_SIZE (4u)
+#define FRAME_STAT_OVERFLOW (1u << 0)
+#define FRAME_STAT_RLE (1u << 1)
+#define FRAME_STAT_MORE (1u << 2)
+
+typedef struct {
+    uint32 control;     // control transfers
+    uint32 out_packets; // bulk
+    uint32 out_bytes;
+    uint32 in_packets;
+    uint32 in_bytes;
+} SIM_USB_STATS;
+extern SIM_USB_STATS sim_usb;
+
+// Reset the target and the counters, and run the firmware up to its main loop.
+void sim_start(const SIM_TAP *taps, uint8 count);
+void sim_control(uint8 request, uint16 value);
+uint16 sim_control_read(uint8 request, uint16 value, uint8 *buf, uint16 len);
+void sim_out(const uint8 *buf, uint16 len);
+// Run the firmware until an IN transfer ends with a short packet, and return its length.
+uint32 sim_in(uint8 *buf, uint32 max);
+// Run the firmware until it has nothing to do.
+void sim_idle(void);
+void sim_console(uint8 c);
+
+// OpenJTAG protocol: JTAG_WRITE, bulk OUT, and JTAG_READ and bulk IN if resp_len > 0.
+uint16 sim_legacy(const uint8 *cmds, uint16 len, uint8 *resp, uint16 resp_len);
+// The same in the order of OpenOCD: JTAG_READ is sent after the firmware takes the bulk OUT.
+uint16 sim_legacy_openocd(const uint8 *cmds, uint16 len, uint8 *resp, uint16 resp_len);
+// Self-framed protocol: send a frame, and return the TDO length and status of its response.
+// The chunks of the response are joined, and decoded if they are run-length encoded.
+// status is the OR of their status bits except FRAME_STAT_MORE.
+uint32 sim_frame(const uint8 *cmds, uint16 len, uint8 *resp, uint32 max, uint8 *status);
+extern uint16 sim_frame_chunks; // chunks of the last response
+
+void sim_fail(const char *fmt, ...);
+#define CHECK(cond) ((cond) ? (void)0 : sim_fail("%s:%d: %s", __FILE__, __LINE__, #cond))
+
+#endif
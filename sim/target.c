@@ -0,0 +1,289 @@
+/*
+  Host build of the adapter firmware: target model.
+
+  A chain of IEEE 1149.1 TAPs with IDCODE, BYPASS and a user data register,
+  and optionally an ARM JTAG-DP whose MEM-AP accesses a small memory.
+ */
+#include "sim.h"
+#include <string.h>
+
+// Next TAP state for TMS low and high. (the same table as JTAG.c)
+static const uint8 tap_next[16][2] = {{1, 0},   {1, 2},   {3, 9},   {4, 5},   {4, 5},   {6, 8},   {6, 7},   {4, 8},
+                                      {1, 2},   {10, 0},  {11, 12}, {11, 12}, {13, 15}, {13, 14}, {11, 15}, {1, 2}};
+#define TAP_TLR (0)
+#define TAP_CAPTURE_DR (3)
+#define TAP_SHIFT_DR (4)
+#define TAP_UPDATE_DR (8)
+#define TAP_CAPTURE_IR (10)
+#define TAP_SHIFT_IR (11)
+#define TAP_UPDATE_IR (15)
+
+typedef struct {
+    SIM_TAP cfg;
+    uint32 ir, ir_shift;
+    // DR shift register, one bit per byte. Shifting rotates dr_pos instead of the bits.
+    uint8 dr[SIM_DR_BITS];
+    uint16 dr_len, dr_pos;
+    uint8 user[SIM_DR_BITS];
+} TAP;
+
+static TAP taps[SIM_MAX_TAPS];
+static uint8 tap_count;
+static uint8 tap_state;
+
+uint8 sim_dap_wait_percent = 0;
+uint32 sim_dap_waits = 0;
+uint32 sim_dap_mem[SIM_MEM_WORDS];
+static struct {
+    uint32 select, ctrl_stat, csw, tar;
+    uint32 rdata; // result of the last read, captured by the next scan
+    uint8 wait;   // the current scan answered WAIT
+} dap;
+
+uint16 sim_tck_div = 1;
+uint16 sim_tck_limit = 0;
+uint32 sim_tck_clocks = 0;
+static uint32 prng = 0x12345678u;
+
+uint32 sim_random(void) {
+    prng ^= prng << 13;
+    prng ^= prng >> 17;
+    prng ^= prng << 5;
+    return prng;
+}
+
+void sim_seed(uint32 seed) {
+    prng = seed ? seed : 1;
+}
+
+static void dr_load(TAP *t, uint16 len, uint64_t value) {
+    t->dr_len = len;
+    t->dr_pos = 0;
+    for (uint16 k = 0; k < len; k++) {
+        t->dr[k] = (k < 64) ? (value >> k) & 1 : 0;
+    }
+}
+
+static uint8 dr_bit(const TAP *t, uint16 k) {
+    return t->dr[(t->dr_pos + k) % t->dr_len];
+}
+
+static uint64_t dr_value(const TAP *t) {
+    uint64_t v = 0;
+    for (uint16 k = 0; k < t->dr_len && k < 64; k++) {
+        v |= (uint64_t)dr_bit(t, k) << k;
+    }
+    return v;
+}
+
+/**************************************
+ * ARM JTAG-DP
+ *************************************/
+#define DAP_ACK_WAIT (1u)
+#define DAP_ACK_OK (2u)
+#define DAP_CSW_INC_SINGLE (1u << 4)
+#define DAP_IDR (0x24770011u)
+
+static void dap_capture(TAP *t) {
+    dap.wait = (sim_random() % 100) < sim_dap_wait_percent;
+    dr_load(t, 35, dap.wait ? DAP_ACK_WAIT : (DAP_ACK_OK | ((uint64_t)dap.rdata << 3)));
+}
+
+static uint32 *dap_mem(uint32 addr) {
+    return &sim_dap_mem[(addr >> 2) % SIM_MEM_WORDS];
+}
+
+// TAR auto-increment wraps within 1KB, as the ADIv5 minimum.
+static void dap_increment(void) {
+    if ((dap.csw & 0x30) == DAP_CSW_INC_SINGLE) {
+        dap.tar = (dap.tar & ~0x3ffu) | ((dap.tar + 4) & 0x3ffu);
+    }
+}
+
+static void dap_update(TAP *t) {
+    uint64_t v = dr_value(t);
+    uint8 rnw = v & 1;
+    uint8 addr = ((v >> 1) & 3) << 2;
+    uint32 data = (uint32)(v >> 3);
+    if (dap.wait) {
+        sim_dap_waits++;
+        return;
+    }
+    if (t->ir == SIM_DAP_IR_DPACC) {
+        switch (addr) {
+        case 0x4:
+            if (rnw) {
+                dap.rdata = dap.ctrl_stat;
+            } else {
+                dap.ctrl_stat = data;
+            }
+            break;
+        case 0x8:
+            if (rnw) {
+                dap.rdata = dap.select;
+            } else {
+                dap.select = data;
+            }
+            break;
+        case 0xc: // RDBUFF keeps the result of the last AP read.
+            break;
+        }
+        return;
+    }
+    if ((dap.select >> 24) != 0) { // No AP but AP 0.
+        dap.rdata = 0;
+        return;
+    }
+    switch (addr | (dap.select & 0xf0)) {
+    case 0x00:
+        if (rnw) {
+            dap.rdata = dap.csw;
+        } else {
+            dap.csw = data;
+        }
+        break;
+    case 0x04:
+        if (rnw) {
+            dap.rdata = dap.tar;
+        } else {
+            dap.tar = data;
+        }
+        break;
+    case 0x0c:
+        if (rnw) {
+            dap.rdata = *dap_mem(dap.tar);
+        } else {
+            *dap_mem(dap.tar) = data;
+        }
+        dap_increment();
+        break;
+    case 0xfc:
+        dap.rdata = DAP_IDR;
+        break;
+    }
+}
+
+/**************************************
+ * TAP chain
+ *************************************/
+static uint32 reset_ir(const TAP *t) {
+    return t->cfg.idcode ? t->cfg.idcode_ir : (1u << t->cfg.ir_len) - 1;
+}
+
+static void tap_capture_dr(TAP *t) {
+    if (t->cfg.idcode && t->ir == t->cfg.idcode_ir) {
+        dr_load(t, 32, t->cfg.idcode);
+    } else if (t->cfg.user_bits && t->ir == t->cfg.user_ir) {
+        t->dr_len = t->cfg.user_bits;
+        t->dr_pos = 0;
+        memcpy(t->dr, t->user, t->dr_len);
+    } else if (t->cfg.dap && (t->ir == SIM_DAP_IR_DPACC || t->ir == SIM_DAP_IR_APACC)) {
+        dap_capture(t);
+    } else {
+        dr_load(t, 1, 0); // BYPASS
+    }
+}
+
+static void tap_update_dr(TAP *t) {
+    if (t->cfg.user_bits && t->ir == t->cfg.user_ir) {
+        for (uint16 k = 0; k < t->dr_len; k++) {
+            t->user[k] = dr_bit(t, k);
+        }
+    } else if (t->cfg.dap && (t->ir == SIM_DAP_IR_DPACC || t->ir == SIM_DAP_IR_APACC)) {
+        dap_update(t);
+    }
+}
+
+// Shift one bit into a TAP, and return the bit shifted out.
+static uint8 tap_shift(TAP *t, uint8 tdi) {
+    uint8 tdo;
+    if (tap_state == TAP_SHIFT_IR) {
+        tdo = t->ir_shift & 1;
+        t->ir_shift = (t->ir_shift >> 1) | ((uint32)tdi << (t->cfg.ir_len - 1));
+        return tdo;
+    }
+    tdo = t->dr[t->dr_pos];
+    t->dr[t->dr_pos] = tdi;
+    t->dr_pos = (t->dr_pos + 1) % t->dr_len;
+    return tdo;
+}
+
+void sim_target_init(const SIM_TAP *cfg, uint8 count) {
+    memset(taps, 0, sizeof(taps));
+    memset(&dap, 0, sizeof(dap));
+    memset(sim_dap_mem, 0, sizeof(sim_dap_mem));
+    tap_count = count;
+    for (uint8 i = 0; i < count; i++) {
+        taps[i].cfg = cfg[i];
+        dr_load(&taps[i], 1, 0);
+    }
+    sim_dap_wait_percent = 0;
+    sim_dap_waits = 0;
+    sim_tck_limit = 0;
+    sim_tck_clocks = 0;
+    sim_target_trst();
+}
+
+void sim_target_trst(void) {
+    tap_state = TAP_TLR;
+    for (uint8 i = 0; i < tap_count; i++) {
+        taps[i].ir = reset_ir(&taps[i]);
+    }
+}
+
+// Clock TCK once, and return TDO sampled before the edge.
+uint8 sim_target_clock(uint8 tms, uint8 tdi) {
+    uint8 bit = tdi;
+    uint8 i;
+
+    sim_tck_clocks++;
+    switch (tap_state) {
+    case TAP_CAPTURE_DR:
+        for (i = 0; i < tap_count; i++) {
+            tap_capture_dr(&taps[i]);
+        }
+        break;
+    case TAP_CAPTURE_IR:
+        for (i = 0; i < tap_count; i++) {
+            taps[i].ir_shift = 1; // ...01, as IEEE 1149.1 requires.
+        }
+        break;
+    case TAP_SHIFT_DR:
+    case TAP_SHIFT_IR:
+        for (i = 0; i < tap_count; i++) {
+            bit = tap_shift(&taps[i], bit);
+        }
+        break;
+    default:
+        bit = 1; // TDO is not driven, and pulled up.
+        break;
+    }
+    tap_state = tap_next[tap_state][tms & 1];
+    switch (tap_state) {
+    case TAP_TLR:
+        sim_target_trst();
+        break;
+    case TAP_UPDATE_DR:
+        for (i = 0; i < tap_count; i++) {
+            tap_update_dr(&taps[i]);
+        }
+        break;
+    case TAP_UPDATE_IR:
+        for (i = 0; i < tap_count; i++) {
+            taps[i].ir = taps[i].ir_shift;
+        }
+        break;
+    }
+    if (sim_tck_div < sim_tck_limit && sim_random() % sim_tck_limit < (uint32)(sim_tck_limit - sim_tck_div)) {
+        bit ^= 1; // Setup time violated at this speed.
+    }
+    return bit;
+}
+
+uint8 sim_target_state(void) {
+    return tap_state;
+}
+
+uint8 sim_target_user_bit(uint8 tap, uint16 bit) {
+    return taps[tap].user[bit];
+}
@@ -0,0 +1,93 @@
+/*
+  TCK calibration (CMD 15, arg 7) against a target which fails below a divider.
+ */
+#include "sim.h"
+#include <string.h>
+
+#define FASTEST (2u)
+#define SLOWEST (200u)
+#define ITERATIONS (8u)
+#define MAX_SPEEDS (48u) // CAL_MAX_SPEEDS
+
+// Status
+#define CAL_OK (0)
+#define CAL_ERR_CHAIN (2)
+
+static const SIM_TAP chain[] = {{.ir_len = 4, .idcode = 0x4ba00477u, .idcode_ir = 0x0e}, {.ir_len = 5, .idcode = 0}};
+
+typedef struct {
+    uint8 status;
+    uint16 div;
+    uint8 speeds;
+    uint16 hist_div[64];
+    uint8 hist_errors[64];
+} RESULT;
+
+static void calibrate(uint16 fastest, uint16 slowest, RESULT *r) {
+    uint8 cmds[6] = {0x0f | (7 << 4), fastest & 0xff, fastest >> 8, slowest & 0xff, slowest >> 8, ITERATIONS};
+    uint8 resp[256];
+    uint8 status;
+    uint16 n;
+
+    sim_control(JTAG_ENABLE, SESSION_FRAMED);
+    n = sim_frame(cmds, sizeof(cmds), resp, sizeof(resp), &status);
+    sim_control(JTAG_DISABLE, 0);
+    CHECK(status == 0 && n >= 4);
+    r->status = resp[0];
+    r->div = resp[1] | (resp[2] << 8);
+    r->speeds = resp[3];
+    CHECK(n == 4 + r->speeds * 3);
+    for (uint8 k = 0; k < r->speeds; k++) {
+        r->hist_div[k] = resp[4 + k * 3] | (resp[5 + k * 3] << 8);
+        r->hist_errors[k] = resp[6 + k * 3];
+    }
+}
+
+// Each divider is about 1/4 slower than the one before, and the failed ones come first.
+static void check_ladder(const RESULT *r, uint16 fastest, uint16 slowest) {
+    CHECK(r->hist_div[0] == fastest);
+    for (uint8 k = 1; k < r->speeds; k++) {
+        uint16 prev = r->hist_div[k - 1];
+        uint16 step = (prev / 4 > 0) ? prev / 4 : 1;
+        CHECK(r->hist_div[k] == ((prev + step < slowest) ? prev + step : slowest));
+        CHECK(r->hist_errors[k - 1] > 0);
+    }
+}
+
+int main(void) {
+    RESULT r;
+
+    sim_start(chain, 2);
+
+    // The first divider at or above the limit is clean, and is set.
+    for (uint16 limit = 10; limit <= 100; limit += 30) {
+        sim_tck_limit = limit;
+        calibrate(FASTEST, SLOWEST, &r);
+        CHECK(r.status == CAL_OK);
+        check_ladder(&r, FASTEST, SLOWEST);
+        CHECK(r.div == r.hist_div[r.speeds - 1] && r.hist_errors[r.speeds - 1] == 0);
+        CHECK(r.div >= limit && (r.speeds == 1 || r.hist_div[r.speeds - 2] < limit));
+        CHECK(sim_tck_div == r.div);
+        CHECK(sim_target_state() == 0); // Test-Logic-Reset
+    }
+
+    // The ladder from 1 takes more steps than there are slots, and the last one is the slowest.
+    sim_tck_limit = 60000;
+    calibrate(1, 60000, &r);
+    CHECK(r.status == CAL_OK && r.speeds == MAX_SPEEDS);
+    r.speeds--;
+    check_ladder(&r, 1, 60000);
+    CHECK(r.hist_div[MAX_SPEEDS - 2] < 50000 && r.hist_errors[MAX_SPEEDS - 2] > 0);
+    CHECK(r.div == 60000 && r.hist_div[MAX_SPEEDS - 1] == 60000 && r.hist_errors[MAX_SPEEDS - 1] == 0);
+    CHECK(sim_tck_div == 60000);
+
+    // The slowest divider fails as well, so there is no reference IDCODE. The clock is kept.
+    sim_tck_limit = 0;
+    calibrate(20, 20, &r);
+    CHECK(r.status == CAL_OK && r.speeds == 1 && sim_tck_div == 20);
+    sim_tck_limit = 1000;
+    calibrate(FASTEST, 50, &r);
+    CHECK(r.status == CAL_ERR_CHAIN && r.div == 0 && r.speeds == 0);
+    CHECK(sim_tck_div == 20);
+    return 0;
+}
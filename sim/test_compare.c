@@ -0,0 +1,178 @@
+/*
+  TDO compare of CMD 8 and CMD 14 against a 300-bit user data register.
+ */
+#include "sim.h"
+#include <string.h>
+
+#define USER_IR (0x02)
+#define USER_BITS (300u)
+#define USER_BYTES ((USER_BITS + 7) / 8)
+
+static const SIM_TAP chain[] = {{.ir_len = 4, .idcode = 0x4ba00477u, .idcode_ir = 0x0e, .user_ir = USER_IR, .user_bits = USER_BITS}};
+static uint8 pattern[USER_BYTES];
+
+static uint8 reverse8(uint8 b) {
+    uint8 r = 0;
+    for (int i = 0; i < 8; i++) {
+        r = (r << 1) | ((b >> i) & 1);
+    }
+    return r;
+}
+
+static uint32 le32(const uint8 *b) {
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32)b[3] << 24);
+}
+
+// Select the user register, and write the pattern into it.
+static uint16 put_write(uint8 *cmds) {
+    uint16 n = 0;
+    cmds[n++] = 0x05 | (1 << 4); // LSB first
+    cmds[n++] = 0x0e | (3 << 4); // IR, no capture
+    cmds[n++] = 1;
+    cmds[n++] = 4;
+    cmds[n++] = 0;
+    cmds[n++] = USER_IR;
+    cmds[n++] = 0x0e | (2 << 4); // DR, no capture
+    cmds[n++] = 1;
+    cmds[n++] = USER_BITS & 0xff;
+    cmds[n++] = USER_BITS >> 8;
+    memcpy(cmds + n, pattern, USER_BYTES);
+    return n + USER_BYTES;
+}
+
+// Read the register back by CMD 14 with compare. The pattern is shifted in again.
+static uint16 put_compare(uint8 *cmds, const uint8 *expect, const uint8 *mask) {
+    uint16 n = 0;
+    cmds[n++] = 0x0e | (4 << 4); // DR, compare
+    cmds[n++] = 1;
+    cmds[n++] = USER_BITS & 0xff;
+    cmds[n++] = USER_BITS >> 8;
+    for (uint16 k = 0; k < USER_BYTES; k++) {
+        cmds[n++] = pattern[k];
+        cmds[n++] = expect[k];
+        cmds[n++] = mask[k];
+    }
+    return n;
+}
+
+static void test_compare(void) {
+    static uint8 cmds[1024];
+    uint8 expect[USER_BYTES];
+    uint8 mask[USER_BYTES];
+    uint8 tdo[8];
+    uint8 status;
+    uint16 n;
+
+    memcpy(expect, pattern, USER_BYTES);
+    memset(mask, 0xff, USER_BYTES);
+    mask[USER_BYTES - 1] = (1 << (USER_BITS % 8)) - 1;
+
+    sim_control(JTAG_ENABLE, SESSION_FRAMED);
+    n = put_write(cmds);
+    n += put_compare(cmds + n, expect, mask);
+    CHECK(sim_frame(cmds, n, tdo, sizeof(tdo), &status) == 1);
+    CHECK(tdo[0] == 0);
+
+    // The first mismatching bit is reported, and masked bits are ignored.
+    expect[15] ^= 1 << 3;
+    expect[30] ^= 1 << 6;
+    n = put_compare(cmds, expect, mask);
+    CHECK(sim_frame(cmds, n, tdo, sizeof(tdo), &status) == 5);
+    CHECK(tdo[0] == 1 && le32(tdo + 1) == 15 * 8 + 3);
+    mask[15] &= ~(1 << 3);
+    n = put_compare(cmds, expect, mask);
+    CHECK(sim_frame(cmds, n, tdo, sizeof(tdo), &status) == 5);
+    CHECK(tdo[0] == 1 && le32(tdo + 1) == 30 * 8 + 6);
+    mask[30] &= ~(1 << 6);
+    n = put_compare(cmds, expect, mask);
+    CHECK(sim_frame(cmds, n, tdo, sizeof(tdo), &status) == 1);
+    CHECK(tdo[0] == 0);
+    sim_control(JTAG_DISABLE, 0);
+
+    // The same in the OpenJTAG protocol, where the triplets are split across packets.
+    mask[15] |= 1 << 3;
+    n = put_compare(cmds, expect, mask);
+    CHECK(sim_legacy(cmds, n, tdo, 5) == 5);
+    CHECK(tdo[0] == 1 && le32(tdo + 1) == 15 * 8 + 3);
+}
+
+// CMD 8 with compare in MSB first mode, where bit7 of each TDO byte is shifted first.
+static void test_compare_msb(void) {
+    static uint8 cmds[1024];
+    uint8 tdo[8];
+    uint8 status;
+    uint16 n = 0;
+    uint16 bytes = 296 / 8;
+
+    sim_control(JTAG_ENABLE, SESSION_FRAMED);
+    n = put_write(cmds);
+    cmds[n++] = 0x05;            // MSB first
+    cmds[n++] = 0x01 | (4 << 4); // Shift-DR
+    cmds[n++] = 0x08 | (9 << 4); // last TMS, compare
+    cmds[n++] = 296 & 0xff;
+    cmds[n++] = 296 >> 8;
+    for (uint16 k = 0; k < bytes; k++) {
+        cmds[n++] = 0;
+        cmds[n++] = reverse8(pattern[k]) ^ ((k == 15) ? 0x80 >> 3 : 0);
+        cmds[n++] = 0xff;
+    }
+    cmds[n++] = 0x01 | (1 << 4);
+    CHECK(sim_frame(cmds, n, tdo, sizeof(tdo), &status) == 5);
+    CHECK(tdo[0] == 1 && le32(tdo + 1) == 15 * 8 + 3);
+    CHECK(sim_target_state() == 1);
+    sim_control(JTAG_DISABLE, 0);
+}
+
+// The same with the partial last byte, whose n bits are returned in bit n-1 to bit0.
+// flip is the shifted bit to mismatch, or USER_BITS for none. Return the response length.
+static uint16 compare_msb_partial(uint16 flip, uint8 *tdo) {
+    static uint8 cmds[1024];
+    uint8 status;
+    uint16 n = 0;
+    uint16 len;
+
+    sim_control(JTAG_ENABLE, SESSION_FRAMED);
+    n = put_write(cmds);
+    cmds[n++] = 0x05;            // MSB first
+    cmds[n++] = 0x01 | (4 << 4); // Shift-DR
+    cmds[n++] = 0x08 | (9 << 4); // last TMS, compare
+    cmds[n++] = USER_BITS & 0xff;
+    cmds[n++] = USER_BITS >> 8;
+    for (uint16 k = 0; k < USER_BYTES; k++) {
+        uint8 bits = (k < USER_BITS / 8) ? 8 : USER_BITS % 8;
+        uint8 expect = 0;
+        for (uint8 j = 0; j < bits; j++) {
+            uint8 bit = ((pattern[k] >> j) & 1) ^ (k * 8 + j == flip);
+            expect |= bit << (bits - 1 - j);
+        }
+        cmds[n++] = 0;
+        cmds[n++] = expect;
+        cmds[n++] = (1 << bits) - 1;
+    }
+    cmds[n++] = 0x01 | (1 << 4);
+    len = sim_frame(cmds, n, tdo, 8, &status);
+    CHECK(sim_target_state() == 1);
+    sim_control(JTAG_DISABLE, 0);
+    return len;
+}
+
+static void test_compare_msb_partial(void) {
+    uint8 tdo[8];
+
+    CHECK(compare_msb_partial(USER_BITS, tdo) == 1 && tdo[0] == 0);
+    for (uint16 flip = USER_BITS - USER_BITS % 8; flip < USER_BITS; flip++) {
+        CHECK(compare_msb_partial(flip, tdo) == 5);
+        CHECK(tdo[0] == 1 && le32(tdo + 1) == flip);
+    }
+}
+
+int main(void) {
+    for (uint16 k = 0; k < USER_BYTES; k++) {
+        pattern[k] = (uint8)(sim_random() >> 8);
+    }
+    sim_start(chain, 1);
+    test_compare();
+    test_compare_msb();
+    test_compare_msb_partial();
+    return 0;
+}
@@ -0,0 +1,29 @@
+/*
+  Console commands received while a Run-Test/Idle burst is running.
+ */
+#include "sim.h"
+
+static const SIM_TAP chain[] = {{.ir_len = 4, .idcode = 0x4ba00477u, .idcode_ir = 0x0e}};
+
+#define BURST_CLOCKS (100003u)
+
+int main(void) {
+    uint8 cmds[] = {0x01 | (1 << 4), // Run-Test/Idle
+                    0x09, BURST_CLOCKS & 0xff, (BURST_CLOCKS >> 8) & 0xff, BURST_CLOCKS >> 16, 0};
+    uint8 tdo[4];
+    uint8 status;
+    uint32 clocks;
+
+    sim_start(chain, 1);
+    sim_control(JTAG_ENABLE, SESSION_FRAMED);
+    clocks = sim_tck_clocks;
+    // Received by the next Timer_1 tick, while the burst runs.
+    sim_console('t');
+    sim_console('r');
+    sim_console('b');
+    CHECK(sim_frame(cmds, sizeof(cmds), tdo, sizeof(tdo), &status) == 1);
+    CHECK(tdo[0] == 0);
+    CHECK(sim_tck_clocks - clocks == BURST_CLOCKS + 1); // and the move from Test-Logic-Reset
+    CHECK(sim_target_state() == 1);
+    return 0;
+}
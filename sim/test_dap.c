@@ -0,0 +1,106 @@
+/*
+  CMD 12 and CMD 13 against a DAP which answers WAIT at random.
+ */
+#include "sim.h"
+#include <string.h>
+
+#define ACK_OK (2u)
+#define BLOCK_WORDS (200u)
+#define BLOCKS (3u)
+#define START_ADDR (0x3f0u) // the first block crosses a 1KB boundary
+
+static const SIM_TAP chain[] = {{.ir_len = 4, .idcode = 0x4ba00477u, .idcode_ir = 0x0e, .dap = 1}};
+
+static uint32 le32(const uint8 *b) {
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32)b[3] << 24);
+}
+
+static uint16 put_le(uint8 *buf, uint32 v, uint8 len) {
+    for (uint8 i = 0; i < len; i++) {
+        buf[i] = (uint8)(v >> (i * 8));
+    }
+    return len;
+}
+
+// CMD 12: arg bit0 = APACC, bit1 = read, bit2-3 = A[3:2].
+static uint8 dap_transfer(uint8 ap, uint8 rnw, uint8 addr, uint32 *data) {
+    uint8 cmds[8];
+    uint8 resp[8];
+    uint8 status;
+    uint16 n = 0;
+    cmds[n++] = 0x0c | ((ap | (rnw << 1) | ((addr >> 2) << 2)) << 4);
+    if (!rnw) {
+        n += put_le(cmds + n, *data, 4);
+    }
+    CHECK(sim_frame(cmds, n, resp, sizeof(resp), &status) == 5);
+    *data = le32(resp + 1);
+    return resp[0];
+}
+
+static void test_registers(void) {
+    uint32 data;
+
+    sim_control(JTAG_ENABLE, SESSION_FRAMED);
+    data = 0x50000000u; // CSYSPWRUPREQ, CDBGPWRUPREQ
+    CHECK(dap_transfer(0, 0, 0x4, &data) == ACK_OK);
+    CHECK(dap_transfer(0, 1, 0x4, &data) == ACK_OK && data == 0x50000000u);
+    data = 0xf0; // bank of IDR
+    CHECK(dap_transfer(0, 0, 0x8, &data) == ACK_OK);
+    CHECK(dap_transfer(1, 1, 0xc, &data) == ACK_OK && data == 0x24770011u);
+    data = 0;
+    CHECK(dap_transfer(0, 0, 0x8, &data) == ACK_OK);
+    sim_control(JTAG_DISABLE, 0);
+}
+
+// CMD 13 writes and reads back a block in frames, across 1KB TAR boundaries.
+static void test_block(void) {
+    static uint8 cmds[1024];
+    static uint8 resp[1024];
+    static uint32 words[BLOCKS * BLOCK_WORDS];
+    uint8 status;
+    uint16 n;
+
+    for (uint16 k = 0; k < BLOCKS * BLOCK_WORDS; k++) {
+        words[k] = sim_random();
+    }
+    sim_control(JTAG_ENABLE, SESSION_FRAMED);
+    for (uint16 b = 0; b < BLOCKS; b++) {
+        n = 0;
+        cmds[n++] = 0x0d; // write
+        cmds[n++] = 0;    // AP 0
+        n += put_le(cmds + n, START_ADDR + b * BLOCK_WORDS * 4, 4);
+        n += put_le(cmds + n, BLOCK_WORDS, 2);
+        for (uint16 k = 0; k < BLOCK_WORDS; k++) {
+            n += put_le(cmds + n, words[b * BLOCK_WORDS + k], 4);
+        }
+        CHECK(sim_frame(cmds, n, resp, sizeof(resp), &status) == 3);
+        CHECK(resp[0] == ACK_OK && (resp[1] | (resp[2] << 8)) == BLOCK_WORDS);
+    }
+    for (uint16 k = 0; k < BLOCKS * BLOCK_WORDS; k++) {
+        CHECK(sim_dap_mem[START_ADDR / 4 + k] == words[k]);
+    }
+
+    for (uint16 b = 0; b < BLOCKS; b++) {
+        n = 0;
+        cmds[n++] = 0x0d | (1 << 4); // read
+        cmds[n++] = 0;
+        n += put_le(cmds + n, START_ADDR + b * BLOCK_WORDS * 4, 4);
+        n += put_le(cmds + n, BLOCK_WORDS, 2);
+        CHECK(sim_frame(cmds, n, resp, sizeof(resp), &status) == BLOCK_WORDS * 4 + 3);
+        for (uint16 k = 0; k < BLOCK_WORDS; k++) {
+            CHECK(le32(resp + k * 4) == words[b * BLOCK_WORDS + k]);
+        }
+        CHECK(resp[BLOCK_WORDS * 4] == ACK_OK);
+        CHECK((resp[BLOCK_WORDS * 4 + 1] | (resp[BLOCK_WORDS * 4 + 2] << 8)) == BLOCK_WORDS);
+    }
+    sim_control(JTAG_DISABLE, 0);
+}
+
+int main(void) {
+    sim_start(chain, 1);
+    sim_dap_wait_percent = 30;
+    test_registers();
+    test_block();
+    CHECK(sim_dap_waits > 100);
+    return 0;
+}
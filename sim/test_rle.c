@@ -0,0 +1,84 @@
+/*
+  Self-framed responses longer than InEP buffer, sent in chunks, with and without
+  run-length encoding.
+ */
+#include "sim.h"
+#include <string.h>
+
+#define ACK_OK (2u)
+#define DUMP_WORDS (3000u) // 12000 bytes, many times InEP buffer
+#define DUMP_BYTES (DUMP_WORDS * 4 + 3)
+
+static const SIM_TAP chain[] = {{.ir_len = 4, .idcode = 0x4ba00477u, .idcode_ir = 0x0e, .dap = 1}};
+
+static uint8 dump[DUMP_BYTES];
+
+static uint32 le32(const uint8 *b) {
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32)b[3] << 24);
+}
+
+// Fill the memory with runs of 0x00 and 0xff between random words, as a flash image.
+static void fill_memory(uint8 runs) {
+    for (uint16 k = 0; k < DUMP_WORDS; k++) {
+        if (!runs) {
+            sim_dap_mem[k] = sim_random();
+        } else if (k % 256 < 100) {
+            sim_dap_mem[k] = 0xffffffffu;
+        } else if (k % 256 < 200) {
+            sim_dap_mem[k] = 0;
+        } else {
+            sim_dap_mem[k] = sim_random();
+        }
+    }
+}
+
+// Read the memory by CMD 13 in a single frame, and check the words and the ACK.
+static void read_memory(uint8 *status) {
+    uint8 cmds[8] = {0x0d | (1 << 4), 0, 0, 0, 0, 0, DUMP_WORDS & 0xff, DUMP_WORDS >> 8};
+
+    memset(dump, 0x5a, sizeof(dump));
+    CHECK(sim_frame(cmds, sizeof(cmds), dump, sizeof(dump), status) == DUMP_BYTES);
+    for (uint16 k = 0; k < DUMP_WORDS; k++) {
+        CHECK(le32(dump + k * 4) == sim_dap_mem[k]);
+    }
+    CHECK(dump[DUMP_WORDS * 4] == ACK_OK);
+    CHECK((dump[DUMP_WORDS * 4 + 1] | (dump[DUMP_WORDS * 4 + 2] << 8)) == DUMP_WORDS);
+}
+
+int main(void) {
+    uint8 status;
+    uint32 in_bytes;
+
+    sim_start(chain, 1);
+
+    // Without encoding, the chunks carry every byte.
+    fill_memory(1);
+    sim_control(JTAG_ENABLE, SESSION_FRAMED);
+    in_bytes = sim_usb.in_bytes;
+    read_memory(&status);
+    CHECK(status == 0);
+    CHECK(sim_frame_chunks > DUMP_BYTES / 1024);
+    CHECK(sim_usb.in_bytes - in_bytes == DUMP_BYTES + sim_frame_chunks * FRAME_HDR_SIZE);
+
+    // Runs are encoded chunk by chunk.
+    sim_control(JTAG_ENABLE, SESSION_FRAMED | SESSION_RLE);
+    in_bytes = sim_usb.in_bytes;
+    read_memory(&status);
+    CHECK(status == FRAME_STAT_RLE);
+    CHECK(sim_frame_chunks > DUMP_BYTES / 1024);
+    CHECK(sim_usb.in_bytes - in_bytes < DUMP_BYTES / 2);
+
+    // Random words do not get shorter, and are sent as they are.
+    fill_memory(0);
+    in_bytes = sim_usb.in_bytes;
+    read_memory(&status);
+    CHECK(status == 0);
+    CHECK(sim_usb.in_bytes - in_bytes == DUMP_BYTES + sim_frame_chunks * FRAME_HDR_SIZE);
+
+    // The session goes on after the long responses.
+    fill_memory(1);
+    read_memory(&status);
+    CHECK(status == FRAME_STAT_RLE);
+    sim_control(JTAG_DISABLE, 0);
+    return 0;
+}
@@ -0,0 +1,266 @@
+/*
+  Scans through both protocols against a chain of two TAPs.
+ */
+#include "sim.h"
+#include <string.h>
+
+static const SIM_TAP chain[] = {
+    {.ir_len = 4, .idcode = 0x4ba00477u, .idcode_ir = 0x0e},
+    {.ir_len = 5, .idcode = 0x06413041u, .idcode_ir = 0x01},
+};
+
+static uint32 le32(const uint8 *b) {
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32)b[3] << 24);
+}
+
+// OpenJTAG commands 1-6, LSB first.
+static void test_legacy_idcode(void) {
+    uint8 cmds[32];
+    uint8 tdo[16];
+    uint16 n = 0;
+    cmds[n++] = 0x05 | (1 << 4); // LSB first
+    cmds[n++] = 0x03;            // TAP reset
+    cmds[n++] = 0x01 | (4 << 4); // Shift-DR
+    for (int i = 0; i < 8; i++) {
+        cmds[n++] = 0x06 | (((8 - 1) << 1 | (i == 7)) << 4);
+        cmds[n++] = 0x00;
+    }
+    cmds[n++] = 0x01 | (1 << 4); // Run-Test/Idle
+    cmds[n++] = 0x02;            // Get state
+    CHECK(sim_legacy(cmds, n, tdo, 9) == 9);
+    CHECK(le32(tdo) == chain[1].idcode); // nearest to TDO first
+    CHECK(le32(tdo + 4) == chain[0].idcode);
+    CHECK((tdo[8] & 0x0f) == 1);
+    CHECK(sim_target_state() == 1);
+}
+
+// Keep in sync with PERF in main.c.
+#define PERF_CMD_COUNT (1u)
+#define PERF_IN_OVERFLOW (35u)
+
+// CMD 8 of len bytes through BYPASS on both TAPs, with JTAG_READ sent after the bulk OUT,
+// as OpenOCD does. Check the TDO bytes received, and return how many there are.
+static uint16 legacy_long_shift(uint16 len) {
+    static uint8 cmds[3100];
+    static uint8 tdo[3000];
+    uint16 n = 0;
+    uint16 got;
+
+    cmds[n++] = 0x05 | (1 << 4); // LSB first
+    cmds[n++] = 0x03;            // TAP reset
+    cmds[n++] = 0x0e | (3 << 4); // IR, no capture: BYPASS on both TAPs
+    cmds[n++] = 1;
+    cmds[n++] = 9;
+    cmds[n++] = 0;
+    cmds[n++] = 0xff;
+    cmds[n++] = 0x01;
+    cmds[n++] = 0x01 | (4 << 4); // Shift-DR
+    cmds[n++] = 0x08 | (1 << 4); // last TMS
+    cmds[n++] = (len * 8) & 0xff;
+    cmds[n++] = (len * 8) >> 8;
+    for (int i = 0; i < len; i++) {
+        cmds[n++] = (uint8)(i * 37);
+    }
+    cmds[n++] = 0x01 | (1 << 4); // Run-Test/Idle
+    got = sim_legacy_openocd(cmds, n, tdo, len);
+    // TDO is delayed by 2 bits.
+    for (int k = 0; got == len && k + 2 < len * 8; k++) {
+        uint8 in = ((uint8)((k / 8) * 37) >> (k % 8)) & 1;
+        CHECK(((tdo[(k + 2) / 8] >> ((k + 2) % 8)) & 1) == in);
+    }
+    CHECK(sim_target_state() == 1);
+    return got;
+}
+
+// A response longer than InEP buffer is sent when JTAG_READ comes after the bulk OUT.
+// If the rest of the OUT data does not fit in the firmware, JTAG_READ cannot come, and
+// the TDO which does not fit is dropped.
+// The bytes dropped are counted by JTAG_PERF.
+static void test_legacy_long_shift(void) {
+    uint8 perf[PERF_IN_OVERFLOW * 4 + 4];
+    uint16 got;
+
+    sim_control_read(JTAG_PERF, 1, perf, sizeof(perf));
+    CHECK(legacy_long_shift(1400) == 1400);
+    sim_control_read(JTAG_PERF, 1, perf, sizeof(perf));
+    CHECK(le32(perf + PERF_IN_OVERFLOW * 4) == 0);
+    got = legacy_long_shift(3000);
+    CHECK(got < 3000);
+    sim_control_read(JTAG_PERF, 1, perf, sizeof(perf));
+    CHECK(le32(perf + PERF_IN_OVERFLOW * 4) == 3000u - got);
+    CHECK(legacy_long_shift(1400) == 1400);
+}
+
+// CMD 14 and CMD 8 in the self-framed protocol.
+static void test_framed_scans(void) {
+    uint8 cmds[300];
+    uint8 tdo[300];
+    uint8 status;
+    uint16 n = 0;
+
+    sim_control(JTAG_ENABLE, SESSION_FRAMED);
+    cmds[n++] = 0x0e;    // DR, capture
+    cmds[n++] = 1;       // Run-Test/Idle
+    cmds[n++] = 64;
+    cmds[n++] = 0;
+    memset(cmds + n, 0, 8);
+    n += 8;
+    CHECK(sim_frame(cmds, n, tdo, sizeof(tdo), &status) == 8);
+    CHECK(status == 0);
+    CHECK(le32(tdo) == chain[1].idcode);
+    CHECK(le32(tdo + 4) == chain[0].idcode);
+
+    // BYPASS on both TAPs delays TDO by 2 bits.
+    n = 0;
+    cmds[n++] = 0x0e | (3 << 4); // IR, no capture
+    cmds[n++] = 1;
+    cmds[n++] = 9;
+    cmds[n++] = 0;
+    cmds[n++] = 0xff;
+    cmds[n++] = 0x01;
+    cmds[n++] = 0x01 | (4 << 4); // Shift-DR
+    cmds[n++] = 0x08 | (1 << 4); // last TMS
+    cmds[n++] = (2000 & 0xff);
+    cmds[n++] = (2000 >> 8);
+    for (int i = 0; i < 250; i++) {
+        cmds[n++] = (uint8)(i * 37);
+    }
+    CHECK(sim_frame(cmds, n, tdo, sizeof(tdo), &status) == 250);
+    CHECK((tdo[0] & 0x03) == 0); // BYPASS captures 0
+    for (int k = 0; k < 1998; k++) {
+        uint8 in = ((uint8)((k / 8) * 37) >> (k % 8)) & 1;
+        CHECK(((tdo[(k + 2) / 8] >> ((k + 2) % 8)) & 1) == in);
+    }
+    CHECK(sim_target_state() == 5); // Exit1-DR
+    sim_control(JTAG_DISABLE, 0);
+}
+
+// Long CMD 8 chunks are moved between RAM and the datapath FIFOs by DMA, in both bit
+// orders and without capture. Short shifts are fed by the CPU.
+static void test_dma_scans(void) {
+    uint8 cmds[300];
+    uint8 tdo[300];
+    uint8 status;
+    uint32 dma;
+    uint16 n;
+
+    sim_control(JTAG_ENABLE, SESSION_FRAMED);
+    for (uint8 lsb_first = 0; lsb_first < 2; lsb_first++) {
+        n = 0;
+        cmds[n++] = 0x05 | (lsb_first << 4);
+        cmds[n++] = 0x0e | (3 << 4); // IR, no capture: BYPASS on both TAPs
+        cmds[n++] = 1;
+        cmds[n++] = 9;
+        cmds[n++] = 0;
+        cmds[n++] = 0xff;
+        cmds[n++] = 0x01;
+        cmds[n++] = 0x01 | (4 << 4); // Shift-DR
+        cmds[n++] = 0x08 | (1 << 4); // last TMS
+        cmds[n++] = (2000 & 0xff);
+        cmds[n++] = (2000 >> 8);
+        for (int i = 0; i < 250; i++) {
+            cmds[n++] = (uint8)(i * 29 + lsb_first);
+        }
+        dma = sim_dma_bytes;
+        CHECK(sim_frame(cmds, n, tdo, sizeof(tdo), &status) == 250);
+        CHECK(sim_dma_bytes - dma >= 2 * 200);
+        for (int k = 0; k < 1998; k++) {
+            uint8 tdi = (uint8)((k / 8) * 29 + lsb_first);
+            uint8 in = (tdi >> (lsb_first ? k % 8 : 7 - k % 8)) & 1;
+            uint8 j = lsb_first ? (k + 2) % 8 : 7 - (k + 2) % 8;
+            CHECK(((tdo[(k + 2) / 8] >> j) & 1) == in);
+        }
+        CHECK(sim_target_state() == 5); // Exit1-DR
+    }
+
+    // No capture: DR scan of 2000 bits, Exit1-DR to Run-Test/Idle.
+    n = 0;
+    cmds[n++] = 0x0e | (2 << 4);
+    cmds[n++] = 1;
+    cmds[n++] = (2000 & 0xff);
+    cmds[n++] = (2000 >> 8);
+    memset(cmds + n, 0xa5, 250);
+    n += 250;
+    cmds[n++] = 0x02; // Get state
+    dma = sim_dma_bytes;
+    CHECK(sim_frame(cmds, n, tdo, sizeof(tdo), &status) == 1);
+    CHECK(sim_dma_bytes - dma >= 2 * 200);
+    CHECK((tdo[0] & 0x0f) == 1 && sim_target_state() == 1);
+
+    // IDCODE of both TAPs is 8 bytes.
+    n = 0;
+    cmds[n++] = 0x03; // TAP reset
+    cmds[n++] = 0x0e; // DR, capture
+    cmds[n++] = 1;
+    cmds[n++] = 64;
+    cmds[n++] = 0;
+    memset(cmds + n, 0, 8);
+    n += 8;
+    dma = sim_dma_bytes;
+    CHECK(sim_frame(cmds, n, tdo, sizeof(tdo), &status) == 8);
+    CHECK(sim_dma_bytes == dma);
+    CHECK(le32(tdo) == chain[1].idcode);
+    sim_control(JTAG_DISABLE, 0);
+}
+
+// TMS sequence and Run-Test/Idle burst keep the TAP state in step with the target.
+static void test_tms_and_burst(void) {
+    uint8 cmds[16];
+    uint8 tdo[4];
+    uint8 status;
+    uint32 clocks;
+    uint16 n = 0;
+
+    sim_control(JTAG_ENABLE, SESSION_FRAMED);
+    cmds[n++] = 0x0f | (3 << 4); // TMS sequence
+    cmds[n++] = 7;
+    cmds[n++] = 0;
+    cmds[n++] = 0x1f; // 5 x TMS high, then low: Test-Logic-Reset, Run-Test/Idle
+    cmds[n++] = 0x02;
+    CHECK(sim_frame(cmds, n, tdo, sizeof(tdo), &status) == 1);
+    CHECK((tdo[0] & 0x0f) == 1 && sim_target_state() == 1);
+
+    clocks = sim_tck_clocks;
+    n = 0;
+    cmds[n++] = 0x09;
+    cmds[n++] = 1003 & 0xff;
+    cmds[n++] = 1003 >> 8;
+    cmds[n++] = 0;
+    cmds[n++] = 0;
+    CHECK(sim_frame(cmds, n, tdo, sizeof(tdo), &status) == 1);
+    CHECK(tdo[0] == 0);
+    CHECK(sim_tck_clocks - clocks == 1003);
+    CHECK(sim_target_state() == 1);
+    sim_control(JTAG_DISABLE, 0);
+}
+
+// The commands of a macro are counted in the CMD 15 which runs it, not by themselves.
+static void test_macro_perf(void) {
+    uint8 define[] = {0x0f | (4 << 4), 0, 2, 0xff, 0xff, 0xff, 0xff, 0x01 | (1 << 4), 0x02};
+    uint8 run[] = {0x0f | (5 << 4), 0, 0, 0, 0, 0};
+    uint8 perf[(PERF_CMD_COUNT + 16) * 4];
+    uint8 resp[8];
+    uint8 status;
+
+    sim_control(JTAG_ENABLE, SESSION_FRAMED);
+    CHECK(sim_frame(define, sizeof(define), resp, sizeof(resp), &status) == 1 && resp[0] == 0);
+    sim_control_read(JTAG_PERF, 1, perf, sizeof(perf));
+    CHECK(sim_frame(run, sizeof(run), resp, sizeof(resp), &status) == 2);
+    CHECK((resp[0] & 0x0f) == 1 && resp[1] == 0); // Run-Test/Idle, OK
+    sim_control_read(JTAG_PERF, 1, perf, sizeof(perf));
+    sim_control(JTAG_DISABLE, 0);
+    for (uint8 c = 0; c < 16; c++) {
+        CHECK(le32(perf + (PERF_CMD_COUNT + c) * 4) == (c == 15));
+    }
+}
+
+int main(void) {
+    sim_start(chain, 2);
+    test_legacy_idcode();
+    test_framed_scans();
+    test_dma_scans();
+    test_tms_and_burst();
+    test_legacy_long_shift();
+    test_macro_perf();
+    return 0;
+}
@@ -0,0 +1,188 @@
+/*
+  XSVF replay of vectors longer than a compare chunk, split across CMD 15 frames.
+ */
+#include "sim.h"
+#include <string.h>
+
+#define USER_IR (0x02)
+#define USER_BITS (4000u)
+#define USER_BYTES ((USER_BITS + 7) / 8)
+#define HALF_BITS (USER_BITS / 2)
+#define HALF_BYTES (HALF_BITS / 8)
+
+// XAPP503 instructions
+#define XCOMPLETE (0)
+#define XTDOMASK (1)
+#define XSIR (2)
+#define XRUNTEST (4)
+#define XSDR (3)
+#define XSDRSIZE (8)
+#define XSDRTDO (9)
+#define XSDRB (12)
+#define XSDRC (13)
+#define XSDRE (14)
+#define XSTATE (18)
+#define XENDIR (19)
+#define XENDDR (20)
+
+// Player status
+#define XSVF_OK (0)
+#define XSVF_DONE (1)
+#define XSVF_ERR_TDO (2)
+
+static const SIM_TAP chain[] = {{.ir_len = 4, .idcode = 0x4ba00477u, .idcode_ir = 0x0e, .user_ir = USER_IR, .user_bits = USER_BITS}};
+
+static uint8 file[4 * 4096];
+static uint32 file_len;
+
+static uint32 le32(const uint8 *b) {
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32)b[3] << 24);
+}
+
+static void put(uint8 b) {
+    file[file_len++] = b;
+}
+
+static void put_be32(uint32 v) {
+    for (int i = 3; i >= 0; i--) {
+        put((uint8)(v >> (i * 8)));
+    }
+}
+
+// XSVF stores a vector from its last byte. vec is in shift order, LSB of byte 0 first.
+static void put_vector(const uint8 *vec, uint32 bits) {
+    for (uint32 k = (bits + 7) / 8; k > 0; k--) {
+        put(vec[k - 1]);
+    }
+}
+
+static void put_header(void) {
+    uint8 ir = USER_IR;
+    uint8 mask[USER_BYTES];
+
+    file_len = 0;
+    put(XSTATE);
+    put(0); // Test-Logic-Reset
+    put(XSTATE);
+    put(1); // Run-Test/Idle
+    put(XENDIR);
+    put(0);
+    put(XENDDR);
+    put(0);
+    put(XSIR);
+    put(4);
+    put_vector(&ir, 4);
+    put(XSDRSIZE);
+    put_be32(USER_BITS);
+    memset(mask, 0xff, USER_BYTES);
+    put(XTDOMASK);
+    put_vector(mask, USER_BITS);
+}
+
+// Play the file by CMD 15, a frame per chunk of varying size. Return the last status.
+static uint8 play(uint32 *inst_count) {
+    static uint8 cmds[1024];
+    uint8 resp[8];
+    uint8 status;
+    uint32 pos = 0;
+    uint32 len;
+    uint16 n;
+
+    sim_control(JTAG_ENABLE, SESSION_FRAMED);
+    do {
+        len = 1 + sim_random() % 700;
+        len = (file_len - pos < len) ? file_len - pos : len;
+        n = 0;
+        cmds[n++] = 0x0f | ((pos > 0) << 4);
+        cmds[n++] = len & 0xff;
+        cmds[n++] = len >> 8;
+        cmds[n++] = 0;
+        cmds[n++] = 0;
+        memcpy(cmds + n, file + pos, len);
+        CHECK(sim_frame(cmds, n + len, resp, sizeof(resp), &status) == 5);
+        pos += len;
+        CHECK(pos == file_len || resp[0] != XSVF_DONE);
+    } while (pos < file_len);
+    sim_control(JTAG_DISABLE, 0);
+    *inst_count = le32(resp + 1);
+    return resp[0];
+}
+
+int main(void) {
+    static uint8 a[USER_BYTES];
+    static uint8 b[USER_BYTES];
+    uint32 count;
+
+    for (uint16 k = 0; k < USER_BYTES; k++) {
+        a[k] = (uint8)(sim_random() >> 8);
+        b[k] = (uint8)(sim_random() >> 8);
+    }
+    sim_start(chain, 1);
+
+    // Write a, then b, and read each back while writing the next.
+    put_header();
+    put(XSDR);
+    put_vector(a, USER_BITS); // captures the reset value 0, and the expected TDO is 0
+    put(XSDRTDO);
+    put_vector(b, USER_BITS);
+    put_vector(a, USER_BITS);
+    put(XSDRTDO);
+    put_vector(a, USER_BITS);
+    put_vector(b, USER_BITS);
+    // The same register by halves: b from XSDRB, a from XSDRE, shifted in that order.
+    put(XSDRSIZE);
+    put_be32(HALF_BITS);
+    put(XSDRB);
+    put_vector(b, HALF_BITS);
+    put(XSDRE);
+    put_vector(a + HALF_BYTES, HALF_BITS);
+    put(XSDRSIZE);
+    put_be32(USER_BITS);
+    put(XSDRTDO);
+    put_vector(a, USER_BITS);
+    memcpy(b + HALF_BYTES, a + HALF_BYTES, USER_BYTES - HALF_BYTES);
+    put_vector(b, USER_BITS);
+    put(XCOMPLETE);
+    CHECK(play(&count) == XSVF_DONE);
+    CHECK(count == 16);
+    CHECK(sim_target_state() == 1);
+    for (uint16 k = 0; k < USER_BITS; k++) {
+        CHECK(sim_target_user_bit(0, k) == ((a[k / 8] >> (k % 8)) & 1));
+    }
+
+    // A mismatch in the last chunk of a vector stops the player.
+    put_header();
+    put(XSDRTDO);
+    put_vector(b, USER_BITS);
+    put_vector(a, USER_BITS);
+    put(XSDRTDO);
+    put_vector(b, USER_BITS);
+    b[USER_BYTES - 2] ^= 0x10;
+    put_vector(b, USER_BITS);
+    put(XCOMPLETE);
+    CHECK(play(&count) == XSVF_ERR_TDO);
+    CHECK(count == 9); // including the failed one
+
+    // XSIR ends in XENDIR, or in Run-Test/Idle after XRUNTEST.
+    put_header();
+    put(XENDIR);
+    put(1); // Pause-IR
+    put(XSIR);
+    put(4);
+    put_vector((const uint8 *)"\x0e", 4);
+    put(XCOMPLETE);
+    CHECK(play(&count) == XSVF_DONE);
+    CHECK(sim_target_state() == 13); // Pause-IR
+    put_header();
+    put(XENDIR);
+    put(1);
+    put(XRUNTEST);
+    put_be32(10);
+    put(XSIR);
+    put(4);
+    put_vector((const uint8 *)"\x0e", 4);
+    put(XCOMPLETE);
+    CHECK(play(&count) == XSVF_DONE);
+    CHECK(sim_target_state() == 1);
+    return 0;
+}
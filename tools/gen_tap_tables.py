@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+"""Generate the TAP transition tables of the JTAG component.
+
+The tables in Library01.cylib/JTAG_v0_02/API/JTAG.c are derived from the TAP
+state machine below (IEEE 1149.1, in the state numbering of OpenJTAG):
+
+    python3 tools/gen_tap_tables.py
+
+and the output replaces the tables between the clang-format markers.
+"""
+
+from collections import deque
+
+STATES = [
+    "TestLogicReset", "RunTestIdle", "Sel-DR", "Cap-DR", "Shift-DR", "Exit1-DR", "Pause-DR", "Exit2-DR",
+    "Update-DR", "Sel-IR", "Cap-IR", "Shift-IR", "Exit1-IR", "Pause-IR", "Exit2-IR", "Update-IR",
+]
+
+# Next state for TMS low and high.
+NEXT = [
+    (1, 0), (1, 2), (3, 9), (4, 5), (4, 5), (6, 8), (6, 7), (4, 8),
+    (1, 2), (10, 0), (11, 12), (11, 12), (13, 15), (13, 14), (11, 15), (1, 2),
+]
+
+
+def shortest_path(src, dst):
+    """Return the TMS bits of the shortest path, trying TMS low first."""
+    if src == dst:
+        return []
+    queue = deque([(src, [])])
+    seen = {src}
+    while queue:
+        state, tms = queue.popleft()
+        for bit in (0, 1):
+            n = NEXT[state][bit]
+            if n == dst:
+                return tms + [bit]
+            if n not in seen:
+                seen.add(n)
+                queue.append((n, tms + [bit]))
+    raise ValueError("no path from %s to %s" % (STATES[src], STATES[dst]))
+
+
+def table(name, comment, cell):
+    lines = ["// %s" % comment, "static const uint8 %s[16][16] = {" % name]
+    for src in range(16):
+        cells = [cell(shortest_path(src, dst)) for dst in range(16)]
+        row = " " + ", ".join(cells[:8]) + ",  " + ", ".join(cells[8:])
+        lines.append(row + ("," if src < 15 else ""))
+        if src == 7:
+            lines.append(" ")
+    lines.append("};")
+    return "\n".join(lines)
+
+
+def tms_byte(path):
+    """TMS bits are shifted from the MSB."""
+    value = 0
+    for i, bit in enumerate(path):
+        value |= bit << (7 - i)
+    return "0x%02x" % value
+
+
+def main():
+    assert all(len(shortest_path(s, d)) <= 8 for s in range(16) for d in range(16))
+    print(table("trans_cnt", "transition counts between two states.", lambda p: str(len(p))))
+    print()
+    print(table("trans_TMS", "TMS bit sequence between two states.", tms_byte))
+    print()
+    print("// Next TAP state for TMS low and high.")
+    print("static const uint8 tap_next[16][2] = {")
+    cells = ["{%2d, %2d}" % n for n in NEXT]
+    print(" " + ", ".join(cells[:8]) + ",")
+    print(" " + ", ".join(cells[8:]))
+    print("};")
+
+
+if __name__ == "__main__":
+    main()
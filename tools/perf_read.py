@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+"""Read the performance counters of PSoC5 OpenJTAG Adapter.
+
+The counters (see PERF in main.c) are read by JTAG_PERF vendor request,
+and can be read while OpenOCD is using the adapter.
+
+usage: perf_read.py [--reset] [--vid VID] [--pid PID]
+"""
+
+import argparse
+import struct
+
+JTAG_PERF = 0xD4
+BUS_CLK_HZ = 76000000
+PERF_BUCKETS = 16
+
+# Keep in sync with PERF in main.c.
+FIELDS = [
+    ("cycles", 1),
+    ("cmd_count", 16),
+    ("cmd_cycles", 16),
+    ("out_bytes", 1),
+    ("in_bytes", 1),
+    ("in_overflow", 1),
+    ("bits", 1),
+    ("jtag_wait_cycles", 1),
+    ("out_wait_cycles", 1),
+    ("send_cycles", 1),
+    ("queue_latency", PERF_BUCKETS),
+    ("resp_latency", PERF_BUCKETS),
+]
+PERF_SIZE = 4 * sum(n for _, n in FIELDS)
+
+
+def unpack(data):
+    words = struct.unpack("<%dI" % (len(data) // 4), data)
+    perf = {}
+    i = 0
+    for name, n in FIELDS:
+        perf[name] = words[i] if n == 1 else list(words[i:i + n])
+        i += n
+    return perf
+
+
+def percent(cycles, total):
+    return 100.0 * cycles / total if total else 0.0
+
+
+def print_histogram(name, hist):
+    print("%s:" % name)
+    for n, count in enumerate(hist):
+        if count:
+            low = 0 if n == 0 else 1 << n
+            print("  %6d-%-6dus %d" % (low, (2 << n) - 1, count))
+
+
+def report(perf):
+    cycles = perf["cycles"]
+    sec = cycles / float(BUS_CLK_HZ)
+    print("elapsed %.3fs" % sec)
+    print("USB OUT %d bytes, IN %d bytes, %d bits shifted" % (perf["out_bytes"], perf["in_bytes"], perf["bits"]))
+    if perf["in_overflow"]:
+        print("IN overflow: %d TDO bytes lost" % perf["in_overflow"])
+    for name in ("jtag_wait_cycles", "out_wait_cycles", "send_cycles"):
+        print("%-17s %10d cycles %5.1f%%" % (name, perf[name], percent(perf[name], cycles)))
+    print("cmd  count      cycles  cycles/cmd")
+    for cmd in range(16):
+        count = perf["cmd_count"][cmd]
+        if count or perf["cmd_cycles"][cmd]:
+            print("%3d %6d %11d %11.1f" % (cmd, count, perf["cmd_cycles"][cmd],
+                                           perf["cmd_cycles"][cmd] / float(count) if count else 0.0))
+    print_histogram("OUT packet queue latency", perf["queue_latency"])
+    print_histogram("Response latency", perf["resp_latency"])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--reset", action="store_true", help="reset the counters after reading")
+    parser.add_argument("--vid", type=lambda s: int(s, 0), default=0x04B4)
+    parser.add_argument("--pid", type=lambda s: int(s, 0), default=0x0007)
+    args = parser.parse_args()
+
+    import usb.core
+
+    dev = usb.core.find(idVendor=args.vid, idProduct=args.pid)
+    if dev is None:
+        raise SystemExit("adapter not found")
+    data = bytes(dev.ctrl_transfer(0xC0, JTAG_PERF, 1 if args.reset else 0, 0, PERF_SIZE))
+    if len(data) != PERF_SIZE:
+        raise SystemExit("short read: %d bytes" % len(data))
+    report(unpack(data))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+"""Run-length encoding of PSoC5 OpenJTAG Adapter responses.
+
+Reference codec of the SESSION_RLE response encoding (see rle_encode() in
+main.c). A response longer than the adapter's buffer is sent in chunks, and
+each chunk but the last has status bit2 (FRAME_STAT_MORE) set. Each chunk is
+encoded on its own, and one with status bit1 (FRAME_STAT_RLE) set carries its
+TDO bytes encoded:
+
+  control 0x00-0x7f: 1-128 literal bytes follow
+  control 0x80-0xff: the next byte is repeated 3-130 times
+
+usage: rle.py [-e] [INPUT [OUTPUT]]
+"""
+
+import argparse
+import sys
+
+FRAME_STAT_RLE = 1 << 1
+FRAME_STAT_MORE = 1 << 2
+MAX_LITERAL = 128
+MIN_RUN = 3
+MAX_RUN = 130
+
+
+def encode(data):
+    """Encode data in the same way as the adapter."""
+    out = bytearray()
+    i = 0
+    lit = 0
+    while i <= len(data):
+        run = 1
+        while i + run < len(data) and data[i + run] == data[i] and run < MAX_RUN:
+            run += 1
+        if i == len(data) or run >= MIN_RUN:
+            while lit < i:
+                n = min(i - lit, MAX_LITERAL)
+                out.append(n - 1)
+                out += data[lit:lit + n]
+                lit += n
+            if i == len(data):
+                break
+            out.append(0x80 | (run - MIN_RUN))
+            out.append(data[i])
+            i += run
+            lit = i
+        else:
+            i += run
+    return bytes(out)
+
+
+def decode(data):
+    """Decode the TDO bytes of a response."""
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        c = data[i]
+        if c < 0x80:
+            n = c + 1
+            if i + 1 + n > len(data):
+                raise ValueError("truncated literal at %d" % i)
+            out += data[i + 1:i + 1 + n]
+            i += 1 + n
+        else:
+            if i + 1 >= len(data):
+                raise ValueError("truncated run at %d" % i)
+            out += bytes([data[i + 1]]) * (c - 0x80 + MIN_RUN)
+            i += 2
+    return bytes(out)
+
+
+def decode_response(status, payload):
+    """Return the TDO bytes of a chunk of a self-framed response."""
+    return decode(payload) if status & FRAME_STAT_RLE else payload
+
+
+def join_chunks(chunks):
+    """Return the TDO bytes and the status of a response sent in chunks.
+
+    chunks is a list of (status, payload), up to the chunk without
+    FRAME_STAT_MORE. The status is the OR of theirs without FRAME_STAT_MORE.
+    """
+    tdo = bytearray()
+    status = 0
+    for chunk_status, payload in chunks:
+        tdo += decode_response(chunk_status, payload)
+        status |= chunk_status
+    return bytes(tdo), status & ~FRAME_STAT_MORE
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-e", "--encode", action="store_true", help="encode instead of decode")
+    parser.add_argument("input", nargs="?", default="-")
+    parser.add_argument("output", nargs="?", default="-")
+    args = parser.parse_args()
+
+    if args.input == "-":
+        data = sys.stdin.buffer.read()
+    else:
+        with open(args.input, "rb") as f:
+            data = f.read()
+    data = encode(data) if args.encode else decode(data)
+    if args.output == "-":
+        sys.stdout.buffer.write(data)
+    else:
+        with open(args.output, "wb") as f:
+            f.write(data)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+"""Find the fastest TCK of PSoC5 OpenJTAG Adapter for the connected target.
+
+Sends the TCK calibration command (CMD 15, arg 7) in a self-framed session, and
+prints the error histogram. Run it before OpenOCD, and use the result for
+`adapter speed`. The divider stays set until the adapter is re-enumerated or
+the clock is set again.
+
+--simulate previews the report without hardware. It steps through the
+dividers in Python against a timing-error model, and does not run or check
+the adapter's calibration, which is tested by sim/test_calibrate.c.
+
+usage: tck_calibrate.py [--fastest DIV] [--slowest DIV] [-n N] [--simulate KHZ [--noise P]]
+"""
+
+import argparse
+import random
+import struct
+
+CLK_JTAG_KHZ = 76000
+JTAG_ENABLE = 0xD0
+JTAG_DISABLE = 0xD1
+SESSION_FRAMED = 1
+IN_EP = 0x81
+OUT_EP = 0x02
+EP_SIZE = 64
+
+# Keep in sync with CAL_STATUS and CAL_MAX_SPEEDS in main.c.
+STATUS = {0: "OK", 1: "no divider passed", 2: "chain broken (TDO stuck or no BYPASS path)"}
+MAX_SPEEDS = 48
+
+
+def dividers(fastest, slowest):
+    """Dividers tried by the adapter, from the fastest."""
+    fastest = max(fastest, 1)
+    slowest = max(slowest, fastest)
+    div = fastest
+    for k in range(MAX_SPEEDS):
+        yield div
+        if div == slowest:
+            break
+        div = min(div + max(div // 4, 1), slowest) if k < MAX_SPEEDS - 2 else slowest
+
+
+def command(fastest, slowest, iterations):
+    return struct.pack("<BHHB", 0x0F | 7 << 4, fastest, slowest, iterations)
+
+
+def parse_response(data):
+    status, div, speeds = struct.unpack_from("<BHB", data)
+    hist = [struct.unpack_from("<HB", data, 4 + 3 * k) for k in range(speeds)]
+    return status, div, hist
+
+
+def logistic_model(limit_div, noise=0.0, width=0.1):
+    """Timing-error model: the probability that an iteration fails at a divider.
+
+    Iterations fail more often as the divider goes below limit_div, the
+    slowest divider at which setup/hold times are violated, plus random
+    noise (e.g. from crosstalk) at any speed."""
+
+    def failure(div):
+        margin = (div - limit_div) / float(limit_div)
+        p = 1.0 / (1.0 + pow(2.718281828, margin / width * 4))
+        return min(1.0, p + noise)
+
+    return failure
+
+
+def simulate(fastest, slowest, iterations, failure, rng=random):
+    """Return a response in the adapter's format, from the error model."""
+    iterations = max(iterations, 1)
+    hist = []
+    status, chosen = 1, 0
+    for div in dividers(fastest, slowest):
+        errors = sum(1 for _ in range(iterations) if rng.random() < failure(div))
+        hist.append((div, errors))
+        if errors == 0:
+            status, chosen = 0, div
+            break
+    data = struct.pack("<BHB", status, chosen, len(hist))
+    for div, errors in hist:
+        data += struct.pack("<HB", div, errors)
+    return data
+
+
+def run(dev, payload, seq=1):
+    dev.ctrl_transfer(0x40, JTAG_ENABLE, SESSION_FRAMED, 0, None)
+    try:
+        dev.write(OUT_EP, struct.pack("<HBB", len(payload), seq, 0) + payload)
+        data = bytearray()
+        while True:
+            packet = dev.read(IN_EP, EP_SIZE, timeout=60000)
+            data += packet
+            if len(packet) < EP_SIZE:
+                break
+        length, rseq, status = struct.unpack_from("<HBB", data)
+        if rseq != seq or status != 0:
+            raise SystemExit("bad response header: seq %d, status %d" % (rseq, status))
+        return bytes(data[4:4 + length])
+    finally:
+        dev.ctrl_transfer(0x40, JTAG_DISABLE, 0, 0, None)
+
+
+def report(status, div, hist, iterations):
+    print("divider      TCK  failed")
+    for d, errors in hist:
+        print("%7d %6.0fkHz  %3d/%d %s" % (d, CLK_JTAG_KHZ / float(d), errors, iterations, "#" * errors))
+    if status == 0:
+        print("fastest clean TCK: divider %d, %.0f kHz" % (div, CLK_JTAG_KHZ / float(div)))
+    else:
+        print("failed: %s" % STATUS.get(status, status))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--fastest", type=int, default=2, help="fastest divider to try")
+    parser.add_argument("--slowest", type=int, default=760, help="slowest divider, assumed to work (100kHz)")
+    parser.add_argument("-n", "--iterations", type=int, default=20, help="clean iterations needed (1-255)")
+    parser.add_argument("--vid", type=lambda s: int(s, 0), default=0x04B4)
+    parser.add_argument("--pid", type=lambda s: int(s, 0), default=0x0007)
+    parser.add_argument("--simulate", type=float, metavar="KHZ", help="preview the report for a modelled target which fails above KHZ")
+    parser.add_argument("--noise", type=float, default=0.0, help="simulated failure probability at any speed")
+    args = parser.parse_args()
+    iterations = min(max(args.iterations, 1), 255)
+
+    if args.simulate:
+        model = logistic_model(CLK_JTAG_KHZ / args.simulate, args.noise)
+        data = simulate(args.fastest, args.slowest, iterations, model)
+    else:
+        import usb.core
+
+        dev = usb.core.find(idVendor=args.vid, idProduct=args.pid)
+        if dev is None:
+            raise SystemExit("adapter not found")
+        data = run(dev, command(args.fastest, args.slowest, iterations))
+    report(*parse_response(data), iterations=iterations)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+"""Decode the KitProg COM port output of PSoC5 OpenJTAG Adapter.
+
+Text is passed through as is. Binary trace records (see TRACE in main.c)
+are formatted one per line.
+
+usage: trace_decode.py [-b BAUD] PORT_OR_FILE
+"""
+
+import argparse
+import sys
+
+TRACE_SYNC = 0xA5
+TRACE_REC_SIZE = 8
+
+# Keep in sync with TRACE_EVENT in main.c.
+EVENTS = {
+    1: ("LOST", lambda a: "%d events" % (a[0] | a[1] << 8)),
+    2: ("SET_CLOCK", lambda a: "div=%d (%.1fkHz)" % (a[0] | a[1] << 8, 76000.0 / max(1, a[0] | a[1] << 8))),
+    3: ("TAP_RESET", lambda a: ""),
+    4: ("HW_RESET", lambda a: ""),
+    5: ("SHIFT_DIR", lambda a: "LSB" if a[0] else "MSB"),
+    6: ("VTREF", lambda a: "%.3fV" % ((a[0] | a[1] << 8) / 1000.0)),
+    7: ("TARGET_POWER", lambda a: "On" if a[0] else "Off"),
+    8: ("IN_OVERFLOW", lambda a: "at %d" % (a[0] | a[1] << 8)),
+    9: ("XSVF_ERROR", lambda a: "status=%d inst=%d" % (a[0], a[1])),
+}
+
+
+def format_record(rec):
+    event_id, args = rec[1], rec[2:5]
+    timer = rec[5] | rec[6] << 8
+    tick = rec[7]
+    name, fmt = EVENTS.get(event_id, ("EVENT_%d" % event_id, lambda a: "%02x %02x %02x" % tuple(a)))
+    return "[%3d:%5d] %-12s %s" % (tick, timer, name, fmt(args))
+
+
+def decode(stream, out):
+    rec = bytearray()
+    text = bytearray()
+    while True:
+        data = stream.read(1)
+        if not data:
+            break
+        b = data[0]
+        if rec:
+            rec.append(b)
+            if len(rec) == TRACE_REC_SIZE:
+                out.write(format_record(rec) + "\n")
+                rec = bytearray()
+        elif b == TRACE_SYNC:
+            if text:
+                out.write(text.decode("ascii", "replace"))
+                text = bytearray()
+            rec.append(b)
+        else:
+            text.append(b)
+            if b in (0x0A, 0x0D):
+                out.write(text.decode("ascii", "replace"))
+                text = bytearray()
+        out.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("source", help="serial port (e.g. COM3, /dev/ttyACM0) or captured file, '-' for stdin")
+    parser.add_argument("-b", "--baud", type=int, default=921600)
+    args = parser.parse_args()
+
+    if args.source == "-":
+        decode(sys.stdin.buffer, sys.stdout)
+    elif args.source.startswith(("COM", "/dev/")):
+        import serial
+
+        with serial.Serial(args.source, args.baud) as port:
+            decode(port, sys.stdout)
+    else:
+        with open(args.source, "rb") as f:
+            decode(f, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()